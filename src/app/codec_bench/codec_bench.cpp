@@ -0,0 +1,278 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "network/clock.hpp"
+#include "network/midi_codec.hpp"
+#include "network/wire.hpp"
+
+#define FUZZ_ROUNDS        10000    // Random packets tried per packet type.
+#define DEFAULT_ITERATIONS 10000000 // Encodes/decodes timed per benchmark.
+#define GUARD_BYTES        16       // Canary bytes checked after each buffer.
+#define GUARD_VALUE        0xA5     // What the canary bytes are filled with.
+#define MAX_FUZZ_EVENTS    32       // Most midi events in a fuzzed message.
+
+// Keeps the benchmark loops from being optimized away.
+static volatile uint64_t sink;
+
+static uint8_t random_byte() {
+   return (uint8_t)(rand() & 0xFF);
+}
+
+static void random_fill(void *out, uint32_t len) {
+   for (uint32_t i = 0; i < len; ++i) {
+      ((uint8_t *)out)[i] = random_byte();
+   }
+}
+
+// Returns true if the GUARD_BYTES after buf + len were left alone.
+static bool guard_intact(const uint8_t *buf, uint32_t len) {
+   for (uint32_t i = 0; i < GUARD_BYTES; ++i) {
+      if (buf[len + i] != GUARD_VALUE) {
+         return false;
+      }
+   }
+   return true;
+}
+
+// Checks one packet type: random packets have to come back out of
+// decode_packet() exactly as they went into encode_packet(), encoding into a
+// buffer that is too small has to fail without writing past it, and
+// decoding a packet that was cut short has to fail. min_len is the shortest
+// buffer the decoder is allowed to accept (the handshake's trailing fields
+// are optional). Returns the number of failures.
+template <typename T>
+static uint32_t fuzz_packet(const char *name, uint32_t min_len) {
+   std::vector<uint8_t> buf(sizeof(T) + GUARD_BYTES);
+   std::vector<uint8_t> exact;
+   uint32_t failures = 0;
+   uint32_t cut;
+   T in;
+   T out;
+
+   for (int round = 0; round < FUZZ_ROUNDS; ++round) {
+      random_fill(&in, sizeof(T));
+      memset(buf.data(), GUARD_VALUE, buf.size());
+      if (encode_packet(in, buf.data(), sizeof(T)) != sizeof(T) ||
+            !guard_intact(buf.data(), sizeof(T))) {
+         ++failures;
+         continue;
+      }
+
+      // Decode out of a buffer of exactly the right size so a read past the
+      // end shows up under valgrind or the address sanitizer.
+      exact.assign(buf.begin(), buf.begin() + sizeof(T));
+      random_fill(&out, sizeof(T));
+      if (decode_packet(exact.data(), exact.size(), &out) != sizeof(T) ||
+            memcmp(&in, &out, sizeof(T)) != 0) {
+         ++failures;
+      }
+
+      // Too small a buffer to encode into.
+      cut = rand() % sizeof(T);
+      memset(buf.data(), GUARD_VALUE, buf.size());
+      if (encode_packet(in, buf.data(), cut) != 0 ||
+            !guard_intact(buf.data(), cut)) {
+         ++failures;
+      }
+
+      // Too little of the packet to decode.
+      exact.resize(rand() % min_len);
+      if (decode_packet(exact.data(), exact.size(), &out) != 0) {
+         ++failures;
+      }
+
+      // Garbage is fine to decode as long as it is in bounds.
+      exact.resize(rand() % (sizeof(T) * 2));
+      random_fill(exact.data(), exact.size());
+      if (decode_packet(exact.data(), exact.size(), &out) > exact.size()) {
+         ++failures;
+      }
+   }
+
+   printf("%-18s %4lu bytes  %s\n", name, (unsigned long)sizeof(T),
+         failures == 0 ? "ok" : "FAILED");
+   return failures;
+}
+
+// Returns a random channel message, which is all the song sends as events.
+static MyPmEvent random_event(uint32_t timestamp) {
+   MyPmEvent event;
+   event.message[0] = 0x80 | (random_byte() & 0x7F);
+   if (event.message[0] >= 0xF0) {
+      event.message[0] &= 0xEF;
+   }
+   event.message[1] = random_byte() & 0x7F;
+   event.message[2] = midi_data_bytes(event.message[0]) > 1 ?
+      random_byte() & 0x7F : 0;
+   event.timestamp = timestamp;
+   return event;
+}
+
+// Checks that messages of random events decode to what was encoded in the
+// given midi format, and that decoding garbage or a message cut short stays
+// in bounds. Returns the number of failures.
+static uint32_t fuzz_midi(const char *name, uint8_t format) {
+   std::vector<MyPmEvent> events;
+   std::vector<uint8_t> buf;
+   MidiEncoder encoder;
+   MidiDecoder decoder;
+   MyPmEvent event;
+   uint32_t failures = 0;
+   uint32_t timestamp;
+   uint32_t offset;
+   uint32_t len;
+
+   for (int round = 0; round < FUZZ_ROUNDS; ++round) {
+      events.clear();
+      timestamp = rand();
+      for (int i = rand() % MAX_FUZZ_EVENTS; i >= 0; --i) {
+         // Mostly small steps forward, now and then a jump either way.
+         timestamp += rand() % 8 == 0 ? rand() : rand() % 100;
+         events.push_back(random_event(timestamp));
+      }
+
+      encoder.reset(format);
+      buf.resize(events.size() * MAX_ENCODED_EVENT);
+      len = 0;
+      for (uint32_t i = 0; i < events.size(); ++i) {
+         len += encoder.encode(events[i], buf.data() + len);
+      }
+      buf.resize(len);
+
+      decoder.reset(format);
+      offset = 0;
+      for (uint32_t i = 0; i < events.size(); ++i) {
+         if (!decoder.decode(buf.data(), buf.size(), &offset, &event) ||
+               memcmp(&event, &events[i], sizeof(MyPmEvent)) != 0) {
+            ++failures;
+            break;
+         }
+      }
+      if (offset != buf.size()) {
+         ++failures;
+      }
+
+      // Cut the message short, the last event must not decode.
+      buf.resize(rand() % buf.size());
+      decoder.reset(format);
+      offset = 0;
+      while (decoder.decode(buf.data(), buf.size(), &offset, &event)) {}
+      if (offset > buf.size()) {
+         ++failures;
+      }
+
+      // Garbage.
+      random_fill(buf.data(), buf.size());
+      decoder.reset(format);
+      offset = 0;
+      while (decoder.decode(buf.data(), buf.size(), &offset, &event)) {}
+      if (offset > buf.size()) {
+         ++failures;
+      }
+   }
+
+   printf("%-18s %10s  %s\n", name, "", failures == 0 ? "ok" : "FAILED");
+   return failures;
+}
+
+// Prints how long an iteration of the loop which ran from start took.
+static void print_timing(const char *name, nsec_t start, uint64_t iterations) {
+   printf("%-34s %8.2f ns/op\n", name,
+         (double)(clock_now() - start) / iterations);
+}
+
+// Times reading and writing the header of a midi message and a sync packet
+// by overlaying their packed structs on a buffer at an odd offset (the way
+// packets used to be handled) against encode_packet() and decode_packet().
+static void benchmark(uint64_t iterations) {
+   uint8_t buf[MAX_BUF_SIZE];
+   uint8_t *odd = buf + 1;
+   Packet_Header header;
+   Sync_Packet sync;
+   nsec_t start;
+
+   memset(buf, 0, sizeof(buf));
+   random_fill(&header, sizeof(Packet_Header));
+   random_fill(&sync, sizeof(Sync_Packet));
+
+   start = clock_now();
+   for (uint64_t i = 0; i < iterations; ++i) {
+      header.seq_num = i;
+      *(Packet_Header *)odd = header;
+      sink += ((Packet_Header *)odd)->seq_num;
+   }
+   print_timing("Packet_Header overlay", start, iterations);
+
+   start = clock_now();
+   for (uint64_t i = 0; i < iterations; ++i) {
+      header.seq_num = i;
+      encode_packet(header, odd, sizeof(Packet_Header));
+      decode_packet(odd, sizeof(Packet_Header), &header);
+      sink += header.seq_num;
+   }
+   print_timing("Packet_Header encode/decode", start, iterations);
+
+   start = clock_now();
+   for (uint64_t i = 0; i < iterations; ++i) {
+      sync.t1 = i;
+      *(Sync_Packet *)odd = sync;
+      sink += ((Sync_Packet *)odd)->t1;
+   }
+   print_timing("Sync_Packet overlay", start, iterations);
+
+   start = clock_now();
+   for (uint64_t i = 0; i < iterations; ++i) {
+      sync.t1 = i;
+      encode_packet(sync, odd, sizeof(Sync_Packet));
+      decode_packet(odd, sizeof(Sync_Packet), &sync);
+      sink += sync.t1;
+   }
+   print_timing("Sync_Packet encode/decode", start, iterations);
+}
+
+static void print_usage() {
+   printf("Usage: codec_bench [iterations]\n");
+}
+
+int main(int argc, char **argv) {
+   uint64_t iterations = DEFAULT_ITERATIONS;
+   uint32_t failures = 0;
+   char *end;
+
+   if (argc > 2) {
+      print_usage();
+      return 1;
+   }
+   if (argc == 2) {
+      iterations = strtoull(argv[1], &end, 10);
+      if (*end != '\0' || iterations == 0) {
+         printf("Invalid iteration count: '%s'\n", argv[1]);
+         print_usage();
+         return 1;
+      }
+   }
+
+   srand(time(NULL));
+   printf("Round trips (protocol version %d):\n", PROTOCOL_VERSION);
+   failures += fuzz_packet<Packet_Header>("Packet_Header",
+         sizeof(Packet_Header));
+   failures += fuzz_packet<Handshake_Packet>("Handshake_Packet",
+         sizeof(Packet_Header));
+   failures += fuzz_packet<Sync_Packet>("Sync_Packet", sizeof(Sync_Packet));
+   failures += fuzz_packet<Timed_Midi_Header>("Timed_Midi_Header",
+         sizeof(Timed_Midi_Header));
+   failures += fuzz_packet<Parity_Header>("Parity_Header",
+         sizeof(Parity_Header));
+   failures += fuzz_packet<Sysex_Header>("Sysex_Header",
+         sizeof(Sysex_Header));
+   failures += fuzz_midi("fixed midi", midi_format::FIXED);
+   failures += fuzz_midi("compact midi", midi_format::COMPACT);
+
+   printf("\nTimings (%lu iterations):\n", (unsigned long)iterations);
+   benchmark(iterations);
+
+   return failures == 0 ? 0 : 1;
+}
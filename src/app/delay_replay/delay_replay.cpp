@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "network/clock.hpp"
+#include "server/delay_estimator.hpp"
+
+// Estimators compared when none are named on the command line.
+static const char *default_estimators[] = { "mean", "ewma", "srtt", "min",
+   "p50", "p90", "p95", "p99" };
+
+// How far off an estimator's delays were over a trace.
+typedef struct PlayoutError {
+   uint64_t predictions;         // Samples that had an estimate to check.
+   double abs_error;             // Sum of |delay - estimate| (ns).
+   uint64_t late;                // Samples that took longer than estimated.
+   double lateness;              // Sum of how late those were (ns).
+   double slack;                 // Sum of how early the others were (ns).
+   std::vector<nsec_t> late_by;  // How late every prediction was (0 if on
+                                 // time).
+} PlayoutError;
+
+// Reads a trace recorded by the server's -r option into the one way delays
+// each client measured, in the order they were measured.
+static bool read_trace(const char *path,
+      std::map<int, std::vector<nsec_t> >& delays) {
+   FILE *trace;
+   char line[256];
+   int client;
+   long when;
+   long rtt;
+
+   trace = fopen(path, "r");
+   if (trace == NULL) {
+      fprintf(stderr, "Unable to open trace '%s'\n", path);
+      return false;
+   }
+
+   while (fgets(line, sizeof(line), trace) != NULL) {
+      if (sscanf(line, "%d %ld %ld", &client, &when, &rtt) != 3) {
+         continue;
+      }
+      delays[client].push_back((nsec_t)rtt / 2);
+   }
+
+   fclose(trace);
+   return true;
+}
+
+// Feeds every client's delays through its own copy of the estimator. Before
+// each sample goes in, the estimate is what the server would have planned
+// the client's playback around, so the sample shows how late (or early) the
+// client's events would have arrived.
+static PlayoutError replay(const std::string& name,
+      std::map<int, std::vector<nsec_t> >& delays) {
+   PlayoutError error;
+   DelayEstimator *estimator;
+   std::map<int, std::vector<nsec_t> >::iterator client_it;
+   std::vector<nsec_t>::iterator delay_it;
+   nsec_t miss;
+
+   error.predictions = 0;
+   error.abs_error = 0;
+   error.late = 0;
+   error.lateness = 0;
+   error.slack = 0;
+
+   for (client_it = delays.begin(); client_it != delays.end(); ++client_it) {
+      estimator = make_delay_estimator(name);
+      for (delay_it = client_it->second.begin();
+            delay_it != client_it->second.end(); ++delay_it) {
+         if (delay_it != client_it->second.begin()) {
+            miss = *delay_it - estimator->estimate();
+            ++error.predictions;
+            error.abs_error += (double)(miss < 0 ? -miss : miss);
+            if (miss > 0) {
+               ++error.late;
+               error.lateness += (double)miss;
+            }
+            else {
+               error.slack -= (double)miss;
+            }
+            error.late_by.push_back(std::max(miss, (nsec_t)0));
+         }
+         estimator->sample(*delay_it);
+      }
+      delete estimator;
+   }
+
+   return error;
+}
+
+static void print_usage() {
+   printf("Usage: delay_replay [rtt-trace-file] [estimator ...]\n");
+   printf("   Replays the sync round trips a server recorded with -r through "
+         "each delay\n   estimator (%s) and reports how far\n"
+         "   off the delays it planned playback around would have been.\n",
+         delay_estimator_names());
+}
+
+int main(int argc, char **argv) {
+   std::map<int, std::vector<nsec_t> > delays;
+   std::vector<std::string> names;
+   std::map<int, std::vector<nsec_t> >::iterator client_it;
+   DelayEstimator *estimator;
+   PlayoutError error;
+   uint64_t num_samples = 0;
+   uint32_t rank;
+
+   if (argc < 2) {
+      print_usage();
+      return 1;
+   }
+
+   // Check the estimator names before doing any work.
+   for (int i = 2; i < argc; ++i) {
+      estimator = make_delay_estimator(argv[i]);
+      if (estimator == NULL) {
+         printf("Invalid delay estimator: '%s'\n", argv[i]);
+         print_usage();
+         return 1;
+      }
+      names.push_back(estimator->name());
+      delete estimator;
+   }
+   if (names.empty()) {
+      names.assign(default_estimators, default_estimators +
+            sizeof(default_estimators) / sizeof(default_estimators[0]));
+   }
+
+   if (!read_trace(argv[1], delays)) {
+      return 1;
+   }
+   for (client_it = delays.begin(); client_it != delays.end(); ++client_it) {
+      num_samples += client_it->second.size();
+   }
+   printf("%lu clients, %lu samples\n", (unsigned long)delays.size(),
+         (unsigned long)num_samples);
+   if (num_samples == delays.size()) {
+      printf("Not enough samples to replay.\n");
+      return 1;
+   }
+
+   // All times are in ms.
+   printf("%-10s %10s %8s %10s %10s %10s\n", "estimator", "mean |err|",
+         "late %", "mean late", "p99 late", "mean slack");
+   for (uint32_t i = 0; i < names.size(); ++i) {
+      error = replay(names[i], delays);
+
+      rank = (uint32_t)(0.99 * error.late_by.size());
+      rank = std::min(rank, (uint32_t)error.late_by.size() - 1);
+      std::nth_element(error.late_by.begin(), error.late_by.begin() + rank,
+            error.late_by.end());
+
+      printf("%-10s %10.3f %8.2f %10.3f %10.3f %10.3f\n", names[i].c_str(),
+            error.abs_error / error.predictions / NSEC_PER_MSEC,
+            100.0 * error.late / error.predictions,
+            error.late ? error.lateness / error.late / NSEC_PER_MSEC : 0.0,
+            (double)error.late_by[rank] / NSEC_PER_MSEC,
+            error.late < error.predictions ? error.slack /
+            (error.predictions - error.late) / NSEC_PER_MSEC : 0.0);
+   }
+
+   return 0;
+}
@@ -1,4 +1,4 @@
-CXXFLAGS := -O3 -Wall -std=c++0x
+CXXFLAGS := -O3 -Wall -std=c++0x -pthread
 
 #includes += -I$(base_dir)/src/lib/ -L$(lib_dir)
 includes += -I$(base_dir)/src/lib/
@@ -12,10 +12,13 @@
 #include <sys/types.h>
 #include <errno.h>            // errno
 #include <unistd.h>           // access
+#include <algorithm>          // std::upper_bound
 #include <utility>            // std::pair, std::get
 #include "client/client.hpp"
+#include "network/wire.hpp"
 
-enum ParseArgs {MIDI_CHANNEL, DELAY, REMOTE_MACHINE, REMOTE_PORT};
+enum ParseArgs {MIDI_CHANNEL, DELAY, REMOTE_MACHINE, REMOTE_PORT,
+   OUTPUT_LATENCY};
 
 Client::Client(int num_args, char **arg_list) {
 
@@ -38,9 +41,44 @@ Client::Client(int num_args, char **arg_list) {
 Client::~Client() {
 }
 
+void Client::arm_timer() {
+   nsec_t deadline;
+   bool queued = false;
+
+   // Events go to PortMidi output_latency ahead of when they play.
+   if (queued_events.size() > 0) {
+      deadline = queued_events.front().first - msec_to_nsec(output_latency);
+      queued = true;
+   }
+   if (queued_sysex.size() > 0 && (!queued || queued_sysex.front().first -
+            msec_to_nsec(output_latency) < deadline)) {
+      deadline = queued_sysex.front().first - msec_to_nsec(output_latency);
+      queued = true;
+   }
+   if (queued_acks.size() > 0 &&
+         (!queued || queued_acks.front().first < deadline)) {
+      deadline = queued_acks.front().first;
+      queued = true;
+   }
+   if (queued_syncs.size() > 0 &&
+         (!queued || queued_syncs.front().first < deadline)) {
+      deadline = queued_syncs.front().first;
+      queued = true;
+   }
+
+   if (queued) {
+      timer.arm(deadline);
+   }
+   else {
+      timer.disarm();
+   }
+}
+
 void Client::clear_queues() {
    queued_acks.clear();
    queued_events.clear();
+   queued_sysex.clear();
+   partial_sysex.clear();
    queued_syncs.clear();
 }
 
@@ -67,9 +105,12 @@ int Client::check_for_response(uint32_t timeout) {
    int handle_data = 1;
 
    // Select on stdin to see if the user wants to do something
-   config_fd_set_for_stdin();
-   num_fds_available = connection_ready(0);
-   ASSERT(num_fds_available >= 0);
+   num_fds_available = 0;
+   if (stdin_open) {
+      config_fd_set_for_stdin();
+      num_fds_available = connection_ready(0);
+      ASSERT(num_fds_available >= 0);
+   }
    if (num_fds_available) {
       print_debug("handling stdin input!\n");
       handle_stdin();
@@ -102,12 +143,67 @@ void Client::config_fd_set() {
    FD_SET(server_sock, &rdfds);
 }
 
+bool Client::first_delivery(uint32_t seq_num) {
+   uint32_t age;
+
+   if (!seq_seen) {
+      seq_seen = true;
+      newest_seq = seq_num;
+      seen_seqs.reset();
+      seen_seqs.set(0);
+      return true;
+   }
+
+   // A newer message slides the window forward. Sequence numbers are
+   // compared by their difference so they can wrap around.
+   age = newest_seq - seq_num;
+   if ((int32_t)age < 0) {
+      age = seq_num - newest_seq;
+      if (age < SEQ_WINDOW) {
+         seen_seqs <<= age;
+      }
+      else {
+         seen_seqs.reset();
+      }
+      seen_seqs.set(0);
+      newest_seq = seq_num;
+      return true;
+   }
+
+   if (age >= SEQ_WINDOW || seen_seqs.test(age)) {
+      return false;
+   }
+   seen_seqs.set(age);
+   return true;
+}
+
+void Client::forget_stale_sysex() {
+   std::map<uint32_t, PartialSysex>::iterator it;
+
+   // Forget the messages the server has stopped sending (ie. the song was
+   // stopped), and the ones that were queued long enough ago that no more
+   // of their fragments are coming.
+   current_time = clock_now();
+   for (it = partial_sysex.begin(); it != partial_sysex.end();) {
+      if (current_time - it->second.last_fragment >
+            msec_to_nsec(SYSEX_TIMEOUT_MS)) {
+         print_debug("forgetting sysex from seq_num %d\n", it->first);
+         partial_sysex.erase(it++);
+      }
+      else {
+         ++it;
+      }
+   }
+}
+
 void Client::handle_done() {
    fprintf(stderr, "Done state, exiting!\n");
    exit(1);
 }
 
 void Client::handle_handshake() {
+   int len;
+
    // Setup main socket for the client to connect to the server on.
    setup_udp_socket();
 
@@ -116,10 +212,10 @@ void Client::handle_handshake() {
 
    if (check_for_response(1) && client_alive) {
       // Obtain server's response
-      recv_packet_into_buf(sizeof(Handshake_Packet));
+      len = recv_packet_into_buf(sizeof(Handshake_Packet));
 
       // Parse the received data.
-      switch (parse_handshake_ack()) {
+      switch (parse_handshake_ack(len)) {
          case flag::HS_GOOD:
             // Start the midi timer
             Pm_Initialize();
@@ -131,10 +227,29 @@ void Client::handle_handshake() {
             default_device_id = Pm_GetDefaultOutputDeviceID();
             print_debug("default_device_id: %d\n", default_device_id);
 
-            // Setup the output stream for playing midi.
-            Pm_OpenOutput(&stream, default_device_id, NULL, 1, NULL, NULL, 0);
+            // Setup the output stream for playing midi. With a latency
+            // PortMidi schedules the events against the PortTime clock, so it
+            // needs room to hold the events it hasn't played yet.
+            if (output_latency > 0) {
+               Pm_OpenOutput(&stream, default_device_id, NULL,
+                     OUTPUT_BUFFER_SIZE, NULL, NULL, output_latency);
+            }
+            else {
+               Pm_OpenOutput(&stream, default_device_id, NULL, 1, NULL, NULL,
+                     0);
+            }
             print_debug("Opened stream!\n");
 
+            // From here on the reactor watches the socket and stdin, and the
+            // timer wakes it up when something queued is due.
+            ASSERT(reactor.add_fd(server_sock, false));
+            if (stdin_open) {
+               stdin_open = reactor.add_fd(STDIN, false);
+            }
+            if (timer.fd() >= 0) {
+               ASSERT(reactor.add_fd(timer.fd(), false));
+            }
+
             timeout_count = 0;
             send_handshake_fin();
             state = client::TWIDDLE;
@@ -162,9 +277,167 @@ void Client::handle_handshake() {
    }
 }
 
+void Client::handle_midi_msg(uint32_t len, bool recovered) {
+   // A system exclusive fragment is acked once it is stored, however long
+   // its message takes to come in, so it is told apart from a duplicate by
+   // where it goes in its message rather than by its sequence number. It
+   // is never covered by parity.
+   if (midi_header.flag == flag::MIDI_SYSEX) {
+      if (queue_sysex_fragment(len)) {
+         queue_midi_ack(midi_header.seq_num, recovered);
+      }
+      return;
+   }
+
+   // Ack the message (again, if it is a resend whose ack was lost) but only
+   // play it once.
+   queue_midi_ack(midi_header.seq_num, recovered);
+   if (!first_delivery(midi_header.seq_num)) {
+      print_debug("dropping duplicate seq_num %d\n", midi_header.seq_num);
+      return;
+   }
+
+   // Hang on to the message in case a parity message needs it to rebuild
+   // another one.
+   recent_packets.push_back(std::make_pair((uint32_t)midi_header.seq_num,
+            std::vector<uint8_t>(buf, buf + len)));
+   if (recent_packets.size() > FEC_HISTORY) {
+      recent_packets.pop_front();
+   }
+
+   switch (midi_header.flag) {
+      case flag::MIDI:
+         queue_midi_data(len);
+         break;
+      case flag::MIDI_TIMED:
+         queue_timed_midi_data(len);
+         break;
+   }
+}
+
+void Client::handle_parity_msg(uint32_t len) {
+   Parity_Header parity;
+   Packet_Header rebuilt_header;
+   std::vector<uint8_t> rebuilt;
+   std::deque<std::pair<uint32_t, std::vector<uint8_t> > >::reverse_iterator
+      it;
+   uint32_t rebuilt_len;
+   int missing = -1;
+
+   if (decode_packet(buf, len, &parity) == 0) {
+      return;
+   }
+   if (parity.num_packets == 0 || parity.num_packets > MAX_FEC_GROUP) {
+      return;
+   }
+
+   // Parity only helps if exactly one of its messages is missing.
+   for (int i = 0; i < parity.num_packets; ++i) {
+      if (!seq_received(parity.seq_nums[i])) {
+         if (missing >= 0) {
+            print_debug("parity for seq_num %d can't fix two losses\n",
+                  parity.header.seq_num);
+            return;
+         }
+         missing = i;
+      }
+   }
+   if (missing < 0) {
+      return;
+   }
+
+   // XOR every message that did arrive out of the parity, leaving the
+   // missing one.
+   rebuilt.assign(buf + sizeof(Parity_Header), buf + len);
+   rebuilt_len = parity.len_xor;
+   memset(&rebuilt_header, 0, sizeof(Packet_Header));
+   for (int i = 0; i < parity.num_packets; ++i) {
+      if (i == missing) {
+         continue;
+      }
+
+      for (it = recent_packets.rbegin(); it != recent_packets.rend() &&
+            it->first != parity.seq_nums[i]; ++it) {}
+      if (it == recent_packets.rend() || it->second.size() > rebuilt.size()) {
+         return;
+      }
+
+      for (uint32_t j = 0; j < it->second.size(); ++j) {
+         rebuilt[j] ^= it->second[j];
+      }
+      rebuilt_len ^= it->second.size();
+   }
+
+   if (rebuilt_len > rebuilt.size() ||
+         decode_packet(rebuilt.data(), rebuilt_len, &rebuilt_header) == 0 ||
+         rebuilt_header.seq_num != parity.seq_nums[missing]) {
+      print_debug("parity for seq_num %d didn't add up\n",
+            parity.header.seq_num);
+      return;
+   }
+
+   // Handle the rebuilt message as if it had just come in.
+   print_debug("rebuilt seq_num %d from parity\n", parity.seq_nums[missing]);
+   memcpy(buf, rebuilt.data(), rebuilt_len);
+   midi_header = rebuilt_header;
+   handle_midi_msg(rebuilt_len, true);
+}
+
+void Client::handle_server_msg() {
+   int len;
+
+   // Recive the packet into the buffer
+   len = recv_packet_into_buf(MAX_BUF_SIZE);
+
+   // A dead client drops everything the server sends it.
+   if (!client_alive) {
+      return;
+   }
+   forget_stale_sysex();
+
+   // Parse the packet
+   flag::Packet_Flag flag;
+   flag = (flag::Packet_Flag)midi_header.flag;
+
+   print_debug("the server sent seq_num: %d\n", midi_header.seq_num);
+
+   // Midi and parity messages are subject to the simulated packet loss.
+   if ((flag == flag::MIDI || flag == flag::MIDI_TIMED ||
+            flag == flag::MIDI_PARITY || flag == flag::MIDI_SYSEX) &&
+         simulate_loss()) {
+      print_debug("simulating the loss of seq_num %d\n", midi_header.seq_num);
+      return;
+   }
+
+   // This packet has to either be a handshake_fin packet or a sync_ack packet.
+   switch (flag) {
+      case flag::SYNC:
+         queue_sync(len);
+         break;
+      case flag::MIDI:
+      case flag::MIDI_TIMED:
+      case flag::MIDI_SYSEX:
+         handle_midi_msg(len, false);
+         break;
+      case flag::MIDI_PARITY:
+         handle_parity_msg(len);
+         break;
+      default:
+         fprintf(stderr, "Client::handle_server_msg fell through!\n");
+         fprintf(stderr, "packet flag: %d\n", flag);
+         ASSERT(FALSE);
+         break;
+   }
+}
+
 void Client::handle_stdin() {
    std::string user_input;
-   getline(std::cin, user_input);
+   if (!getline(std::cin, user_input)) {
+      // stdin hit EOF, so stop watching it or it will keep waking us up.
+      stdin_open = false;
+      reactor.remove_fd(STDIN);
+      return;
+   }
 
    std::istringstream iss(user_input);
 
@@ -184,6 +457,14 @@ void Client::handle_stdin() {
       clear_queues();
       get_current_time(&timing_checkpoint);
    } 
+   else if (token.compare("loss") == 0) {
+      int temp_loss = -1;
+      iss >> temp_loss;
+      if (temp_loss >= 0 && temp_loss <= 100) {
+         loss_percent = temp_loss;
+         fprintf(stderr, "changing packet loss to %d%%\n", loss_percent);
+      }
+   }
    else if (token.compare("time") == 0) {
       long temp;
       get_current_time(&temp);
@@ -204,6 +485,29 @@ void Client::init() {
    // Set client_alive to 1 to simulate an active client.
    client_alive = 1;
 
+   // No simulated packet loss until the user asks for it.
+   loss_percent = 0;
+   srand((unsigned int)clock_now());
+
+   // No midi messages have been received yet.
+   seq_seen = false;
+   newest_seq = 0;
+
+   // Until the handshake says otherwise the server speaks the fixed format.
+   midi_format = midi_format::FIXED;
+
+   // Watch stdin for commands until it hits EOF.
+   stdin_open = true;
+
+   // Keyboard events are timed from startup until the user says otherwise.
+   get_current_time(&timing_checkpoint);
+
+   // We don't know where the server's clock is until it syncs with us.
+   clock_synced = false;
+   clock_offset = 0;
+   offset_time = 0;
+   clock_skew = 0;
+
    // Set sequence number to 0 since we are just starting.
    seq_num = 0;
 
@@ -213,8 +517,8 @@ void Client::init() {
    // Put object into the HANDSHAKE state.
    state = client::HANDSHAKE;
 
-   // Have the midi_header overlay the buf.
-   midi_header = (Packet_Header *)buf;
+   // Nothing has been received yet.
+   memset(&midi_header, 0, sizeof(Packet_Header));
 
    // Clear the midi_ack's unneeded fields to avoid printout confusion.
    midi_ack.num_midi_events = 0;
@@ -223,30 +527,138 @@ void Client::init() {
    memset(buf, '\0', MAX_BUF_SIZE);
 }
 
-void Client::queue_midi_data() {
-   int buf_offset = sizeof(Packet_Header);
-   uint8_t num_midi_events = midi_header->num_midi_events;
+void Client::queue_midi_data(uint32_t len) {
+   uint32_t buf_offset = sizeof(Packet_Header);
+   uint8_t num_midi_events = midi_header.num_midi_events;
+   MyPmEvent midi_event;
 
-   get_current_time(&current_time);
+   current_time = clock_now();
+   decoder.reset(midi_format);
 
    // Loop through all midi events
    for (int i = 0; i < num_midi_events; ++i) {
       // Pull out each midi message from the buffer
-      my_event = (MyPmEvent *)(buf + buf_offset);
+      if (!decoder.decode(buf, len, &buf_offset, &midi_event)) {
+         print_debug("dropping %d undecodable midi events\n",
+               num_midi_events - i);
+         return;
+      }
 
       // Add the message to the queue along with its timestamp.
-      queued_events.push_back(std::make_pair(current_time + delay, *my_event));
+      queue_midi_event(current_time + msec_to_nsec(delay), &midi_event);
+   }
+}
+
+// Orders queued events by the time to play them at.
+static bool earlier_event(nsec_t play_time,
+      const std::pair<nsec_t, MyPmEvent>& queued) {
+   return play_time < queued.first;
+}
 
-      // Move offset to next midi message
-      buf_offset += SIZEOF_MIDI_EVENT;
+void Client::queue_midi_event(nsec_t play_time, MyPmEvent *event) {
+   // Events almost always show up in order, so this is nearly always a push
+   // onto the back.
+   if (queued_events.empty() || queued_events.back().first <= play_time) {
+      queued_events.push_back(std::make_pair(play_time, *event));
+      return;
+   }
+
+   queued_events.insert(std::upper_bound(queued_events.begin(),
+            queued_events.end(), play_time, earlier_event),
+         std::make_pair(play_time, *event));
+}
+
+void Client::queue_timed_midi_data(uint32_t len) {
+   Timed_Midi_Header timed_header;
+   uint32_t buf_offset = sizeof(Timed_Midi_Header);
+   uint8_t num_midi_events;
+   MyPmEvent midi_event;
+   nsec_t arrival_time;
+   nsec_t play_time;
+
+   if (decode_packet(buf, len, &timed_header) == 0) {
+      return;
+   }
+   num_midi_events = timed_header.header.num_midi_events;
+
+   // The (simulated) network delay still applies to the packet.
+   current_time = clock_now();
+   arrival_time = current_time + msec_to_nsec(delay);
+   decoder.reset(midi_format);
+
+   // Loop through all midi events
+   for (int i = 0; i < num_midi_events; ++i) {
+      // Pull out each midi message from the buffer
+      if (!decoder.decode(buf, len, &buf_offset, &midi_event)) {
+         print_debug("dropping %d undecodable midi events\n",
+               num_midi_events - i);
+         return;
+      }
+
+      // Translate the server's play time into our clock. Events that show up
+      // too late (or before we know the server's clock) play on arrival.
+      play_time = arrival_time;
+      if (clock_synced) {
+         play_time = std::max(arrival_time, to_local_time(
+                  timed_header.base_time +
+                  msec_to_nsec(midi_event.timestamp)));
+      }
+      queue_midi_event(play_time, &midi_event);
    }
 }
 
+bool Client::play_due(nsec_t horizon) {
+   return (queued_events.size() > 0 &&
+         queued_events.front().first <= horizon) ||
+      (queued_sysex.size() > 0 && queued_sysex.front().first <= horizon);
+}
+
 void Client::play_midi_data() {
-   get_current_time(&current_time);
+   int num_events;
+   PtTimestamp now;
+   nsec_t horizon;
+
+   current_time = clock_now();
+
+   if (output_latency > 0) {
+      // Hand PortMidi every event that plays within its latency, timestamped
+      // in the PortTime clock (PortMidi adds the latency back on).
+      now = Pt_Time();
+      horizon = current_time + msec_to_nsec(output_latency);
+      while (play_due(horizon)) {
+         if (sysex_next()) {
+            Pm_WriteSysEx(stream, now + nsec_to_msec(
+                     queued_sysex.front().first - current_time) -
+                  output_latency, queued_sysex.front().second.data());
+            queued_sysex.pop_front();
+            continue;
+         }
+
+         num_events = 0;
+         while (num_events < MAX_WRITE_BATCH && queued_events.size() > 0 &&
+               queued_events.front().first <= horizon && !sysex_next()) {
+            my_event = &(queued_events.front().second);
+            events[num_events].message = Pm_Message(my_event->message[0],
+                  my_event->message[1], my_event->message[2]);
+            events[num_events].timestamp = now + nsec_to_msec(
+                  queued_events.front().first - current_time) - output_latency;
+            ++num_events;
+            queued_events.pop_front();
+         }
+
+         Pm_Write(stream, events, num_events);
+      }
+      return;
+   }
 
    // Play all events that are ready
-   while (queued_events.size() > 0 && queued_events.front().first < current_time) {
+   while (play_due(current_time)) {
+      if (sysex_next()) {
+         Pm_WriteSysEx(stream, 0, queued_sysex.front().second.data());
+         queued_sysex.pop_front();
+         continue;
+      }
+
       // Grab the event
       my_event = &(queued_events.front().second);
 
@@ -271,25 +683,118 @@ void Client::handle_play() {
    ASSERT(FALSE);
 }
 
-void Client::queue_sync() {
+void Client::queue_sync(uint32_t len) {
    print_debug("Client::queue_sync!\n");
-   get_current_time(&current_time);
-   queued_syncs.push_back(std::make_pair(current_time + delay, seq_num));
+   Sync_Packet sync;
+   if (decode_packet(buf, len, &sync) == 0) {
+      return;
+   }
+   sync.header.seq_num = seq_num;
+
+   // The sync (simulated) arrives once the network delay has passed.
+   current_time = clock_now();
+   sync.t2 = current_time + msec_to_nsec(delay);
+   queued_syncs.push_back(std::make_pair((nsec_t)sync.t2, sync));
+}
+
+// Orders queued system exclusive messages by the time to play them at.
+static bool earlier_sysex(nsec_t play_time,
+      const std::pair<nsec_t, std::vector<uint8_t> >& queued) {
+   return play_time < queued.first;
+}
+
+bool Client::queue_sysex_fragment(uint32_t len) {
+   Sysex_Header sysex_header;
+   std::map<uint32_t, PartialSysex>::iterator it;
+   std::deque<std::pair<nsec_t, std::vector<uint8_t> > >::iterator slot;
+   uint32_t fragment;
+   nsec_t play_time;
+
+   if (decode_packet(buf, len, &sysex_header) == 0) {
+      return false;
+   }
+   fragment = len - sizeof(Sysex_Header);
+   if (sysex_header.total_len > MAX_SYSEX_LEN ||
+         sysex_header.offset > sysex_header.total_len ||
+         fragment > sysex_header.total_len - sysex_header.offset) {
+      print_debug("dropping bad sysex fragment seq_num %d\n",
+            sysex_header.header.seq_num);
+      return false;
+   }
+
+   current_time = clock_now();
+   it = partial_sysex.find(sysex_header.first_seq);
+   if (it == partial_sysex.end()) {
+      it = partial_sysex.insert(std::make_pair(
+               (uint32_t)sysex_header.first_seq, PartialSysex())).first;
+      it->second.data.resize(sysex_header.total_len);
+      it->second.total_len = sysex_header.total_len;
+      it->second.received = 0;
+      it->second.queued = false;
+   }
+   if (it->second.total_len != sysex_header.total_len) {
+      return false;
+   }
+
+   // A resend of a fragment that is already in (its ack was lost) only
+   // needs acking again.
+   if (it->second.queued ||
+         !it->second.offsets.insert(sysex_header.offset).second) {
+      print_debug("dropping duplicate sysex fragment seq_num %d\n",
+            sysex_header.header.seq_num);
+      return true;
+   }
+
+   memcpy(it->second.data.data() + sysex_header.offset,
+         buf + sizeof(Sysex_Header), fragment);
+   it->second.received += fragment;
+   it->second.last_fragment = current_time;
+   if (it->second.received < it->second.total_len) {
+      return true;
+   }
+
+   // It's all in, so it plays when asked to (or now, if that has passed).
+   play_time = current_time + msec_to_nsec(delay);
+   if (sysex_header.timed && clock_synced) {
+      play_time = std::max(play_time, to_local_time(sysex_header.base_time +
+               msec_to_nsec(sysex_header.timestamp)));
+   }
+
+   print_debug("queueing %d byte sysex\n", (int)it->second.data.size());
+   slot = queued_sysex.insert(std::upper_bound(queued_sysex.begin(),
+            queued_sysex.end(), play_time, earlier_sysex),
+         std::make_pair(play_time, std::vector<uint8_t>()));
+   slot->second.swap(it->second.data);
+
+   // Hang on to where its fragments went until they stop being resent.
+   it->second.queued = true;
+   it->second.offsets.clear();
+   return true;
 }
 
-void Client::send_sync_ack(uint32_t packet_seq_num) {
+void Client::send_sync_ack(Sync_Packet& sync) {
    int bytes_sent;
 
-   // Build the handshake fin packet
-   midi_header->seq_num = packet_seq_num;
-   midi_header->flag = flag::SYNC_ACK;
+   // The server works out how far our clock is from its own, and how fast
+   // that is changing, from the timestamps of earlier syncs.
+   if (sync.offset_valid) {
+      clock_offset = sync.clock_offset;
+      offset_time = sync.offset_time;
+      clock_skew = sync.skew_ppb / 1e9;
+      clock_synced = true;
+   }
+
+   // Echo the sync back with when it arrived and when it left.
+   current_time = clock_now();
+   sync.header.flag = flag::SYNC_ACK;
+   sync.t3 = current_time;
+   encode_packet(sync, buf, MAX_BUF_SIZE);
 
-   get_current_time(&current_time);
    fprintf(stderr, "responding to sync_ack -- time since event: %lu ms\n",
-      current_time - timing_checkpoint);    
+      nsec_to_msec(current_time) - timing_checkpoint);    
 
-   // Send the handshake fin packet to the server.
-   uint16_t packet_size = sizeof(Packet_Header);
+   // Send the sync ack packet to the server.
+   uint16_t packet_size = sizeof(Sync_Packet);
    bytes_sent = send_buf(server_sock, &server, buf, packet_size);
    ASSERT(bytes_sent == packet_size);
 
@@ -297,13 +802,32 @@ void Client::send_sync_ack(uint32_t packet_seq_num) {
    queued_syncs.pop_front();
 }
 
-flag::Packet_Flag Client::parse_handshake_ack() {
-   Handshake_Packet *hs = (Handshake_Packet *)buf;
-   return (flag::Packet_Flag)(hs->header.flag);
+flag::Packet_Flag Client::parse_handshake_ack(uint32_t len) {
+   Handshake_Packet hs;
+
+   // Servers that predate the midi format or the protocol version only
+   // send the header, and those fields read as zero.
+   if (decode_packet(buf, len, &hs) == 0) {
+      return flag::HS_FAIL;
+   }
+   if (hs.version > PROTOCOL_VERSION) {
+      fprintf(stderr, "server speaks protocol version %d, newer than %d\n",
+            hs.version, PROTOCOL_VERSION);
+      return flag::HS_FAIL;
+   }
+
+   midi_format = midi_format::FIXED;
+   if (hs.midi_format <= midi_format::NEWEST) {
+      midi_format = hs.midi_format;
+   }
+   print_debug("protocol version %d, midi format %d\n", hs.version,
+         midi_format);
+
+   return (flag::Packet_Flag)(hs.header.flag);
 }
 
 bool Client::parse_inputs(int num_args, char **arg_list) {
-   if (num_args != INPUT_ARG_COUNT) {
+   if (num_args != INPUT_ARG_COUNT && num_args != MAX_INPUT_ARG_COUNT) {
       printf("Improper argument count.\n");
       return false;
    }
@@ -331,17 +855,34 @@ bool Client::parse_inputs(int num_args, char **arg_list) {
       return false;
    }
 
+   output_latency = 0;
+   if (num_args == MAX_INPUT_ARG_COUNT) {
+      output_latency = strtol(arg_list[OUTPUT_LATENCY], &endptr, 10);
+      if (endptr == arg_list[OUTPUT_LATENCY] || output_latency < 0) {
+         printf("Invalid output latency: '%s'\n", arg_list[OUTPUT_LATENCY]);
+         printf("Output latency must be 0 or greater.\n");
+         return false;
+      }
+   }
+
    return true;
 }
 
 void Client::print_usage() {
-   printf("Usage: client <midi-channel> <delay> <server-machine> <server-port>\n");
+   printf("Usage: client <midi-channel> <delay> <server-machine> <server-port> "
+         "[output-latency]\n");
 }
 
 int Client::recv_packet_into_buf(uint32_t packet_size) {
    int bytes_recv;
    bytes_recv = recv_buf(server_sock, &server, buf, MAX_BUF_SIZE);
-   seq_num = midi_header->seq_num + 1;
+
+   // Anything too short to carry a header reads as a blank one.
+   if (bytes_recv <= 0 ||
+         decode_packet(buf, bytes_recv, &midi_header) == 0) {
+      memset(&midi_header, 0, sizeof(Packet_Header));
+   }
+   seq_num = midi_header.seq_num + 1;
    return bytes_recv;
 }
 
@@ -349,12 +890,15 @@ void Client::send_handshake() {
    int bytes_sent;
 
    // Build the handshake packet
-   Handshake_Packet *hs = (Handshake_Packet *)buf;
-   hs->header.seq_num = 0;
-   hs->header.flag = flag::HS;
+   Handshake_Packet hs;
+   memset(&hs, 0, sizeof(Handshake_Packet));
+   hs.header.seq_num = 0;
+   hs.header.flag = flag::HS;
+   hs.midi_format = midi_format::NEWEST;
+   hs.version = PROTOCOL_VERSION;
 
    // Send the handshake packet to the server.
-   uint16_t packet_size = sizeof(Handshake_Packet);
+   uint16_t packet_size = encode_packet(hs, buf, MAX_BUF_SIZE);
    bytes_sent = send_buf(server_sock, &server, buf, packet_size);
    ASSERT(bytes_sent == packet_size);
 }
@@ -363,38 +907,45 @@ void Client::send_handshake_fin() {
    int bytes_sent;
 
    print_debug("Client::send_handshake_fin!\n");
-   // Parse the handshake ack to get the seq number.
-   Handshake_Packet *hs = (Handshake_Packet *)buf;
-   ASSERT(hs->header.seq_num == 1);
+   // The handshake ack's header was decoded when it was received.
+   ASSERT(midi_header.seq_num == 1);
 
    // Build the handshake fin packet
-   hs->header.seq_num = seq_num;
-   ASSERT(hs->header.seq_num == 2);
-   hs->header.flag = flag::HS_FIN;
+   Packet_Header fin;
+   memset(&fin, 0, sizeof(Packet_Header));
+   fin.seq_num = seq_num;
+   ASSERT(fin.seq_num == 2);
+   fin.flag = flag::HS_FIN;
 
    // Send the handshake fin packet to the server.
-   uint16_t packet_size = sizeof(Handshake_Packet);
+   uint16_t packet_size = encode_packet(fin, buf, MAX_BUF_SIZE);
    bytes_sent = send_buf(server_sock, &server, buf, packet_size);
    ASSERT(bytes_sent == packet_size);
 }
 
-void Client::queue_midi_ack(uint32_t packet_seq_num) {
-   get_current_time(&current_time);
+void Client::queue_midi_ack(uint32_t packet_seq_num, bool recovered) {
+   current_time = clock_now();
 
-   queued_acks.push_back(std::make_pair(current_time + delay, packet_seq_num));
+   // Get the ack of the message to send.
+   midi_ack.seq_num = packet_seq_num;
+   midi_ack.flag = recovered ? flag::FEC_ACK : flag::MIDI_ACK;
+   queued_acks.push_back(std::make_pair(current_time + msec_to_nsec(delay),
+            midi_ack));
 }
 
-void Client::send_midi_ack(uint32_t packet_seq_num) {
+void Client::send_midi_ack(Packet_Header& ack) {
    int bytes_sent;
 
    print_debug("sending seq_num %d\n", seq_num);
 
-   // Get the ack of the message to send.
-   midi_ack.seq_num = packet_seq_num;
-   midi_ack.flag = flag::MIDI_ACK;
-   uint16_t packet_size = sizeof(Handshake_Packet);
-   bytes_sent = send_buf(server_sock, &server, (uint8_t *)&midi_ack, packet_size);
-   ASSERT(bytes_sent == packet_size);
+   uint8_t ack_buf[sizeof(Packet_Header)];
+   uint16_t packet_size = encode_packet(ack, ack_buf, sizeof(ack_buf));
+
+   // Acks are subject to the simulated packet loss too.
+   if (!simulate_loss()) {
+      bytes_sent = send_buf(server_sock, &server, ack_buf, packet_size);
+      ASSERT(bytes_sent == packet_size);
+   }
 
    // Remove the bookkeeping from the queue
    queued_acks.pop_front();
@@ -425,66 +976,70 @@ void Client::setup_udp_socket() {
    server.sin_port = htons(server_port);  // Use specified port
 }
 
-void Client::twiddle() {
-   // Wait for packet
-   if (check_for_response(0) && client_alive) {
-      // Recive the packet into the buffer
-      recv_packet_into_buf(MAX_BUF_SIZE);
+bool Client::seq_received(uint32_t seq_num) {
+   uint32_t age = newest_seq - seq_num;
 
-      // Parse the packet
-      flag::Packet_Flag flag;
-      flag = (flag::Packet_Flag)midi_header->flag;
+   if (!seq_seen || (int32_t)age < 0) {
+      return false;
+   }
+   return age >= SEQ_WINDOW || seen_seqs.test(age);
+}
 
-      print_debug("the server sent seq_num: %d\n", midi_header->seq_num);
+bool Client::simulate_loss() {
+   return loss_percent > 0 && rand() % 100 < loss_percent;
+}
 
-      // This packet has to either be a handshake_fin packet or a sync_ack packet.
-      switch (flag) {
-         case flag::SYNC:
-            queue_sync();
-            break;
-         case flag::MIDI:
-            queue_midi_data();
-            break;
-         default:
-            fprintf(stderr, "Client::twiddle fell through!\n");
-            fprintf(stderr, "packet flag: %d\n", flag);
-            ASSERT(FALSE);
-            break;
-      }
-   }
+bool Client::sysex_next() {
+   return queued_sysex.size() > 0 && (queued_events.empty() ||
+         queued_sysex.front().first <= queued_events.front().first);
+}
 
-   /*
-      fprintf(stderr, "current_time: %lu\n", current_time);
-      if (queued_acks.size() > 0) {
-      fprintf(stderr, "queued_acks.front().first: %lu\n", queued_acks.front().first);
+nsec_t Client::to_local_time(nsec_t server_time) {
+   return server_time + clock_offset + (nsec_t)(clock_skew *
+         (double)(server_time - offset_time));
+}
+
+void Client::twiddle() {
+   int num_fds_ready;
+   int fd;
+
+   // Sleep until the server or the user says something, or until the next
+   // queued item is due.
+   arm_timer();
+   num_fds_ready = reactor.wait(timer.wait_timeout());
+
+   for (int i = 0; i < num_fds_ready; ++i) {
+      fd = reactor.ready_fd(i);
+      if (fd == server_sock) {
+         handle_server_msg();
       }
-      if (queued_events.size() > 0) {
-      fprintf(stderr, "queued_events.front().first: %lu\n", queued_events.front().first);
+      else if (fd == STDIN) {
+         print_debug("handling stdin input!\n");
+         handle_stdin();
       }
-      */
+      else if (fd == timer.fd()) {
+         timer.clear();
+      }
+   }
 
-   get_current_time(&current_time);
+   current_time = clock_now();
    // Check to see if we need to ack any packets
-   if (queued_acks.size() > 0 && queued_acks.front().first < current_time) {
-
+   while (queued_acks.size() > 0 && queued_acks.front().first <= current_time) {
       // Send the ack
       send_midi_ack(queued_acks.front().second);
    }
 
-   get_current_time(&current_time);
-   // Check to see if we need to play any midi events
-   if (queued_events.size() > 0 &&
-         queued_events.front().first < current_time) {
+   // Check to see if we need to play any midi events (or hand them to
+   // PortMidi ahead of time)
+   if (play_due(current_time + msec_to_nsec(output_latency))) {
 
       // Play the midi data
       play_midi_data();
    }
 
-   get_current_time(&current_time);
-   // Check to see if we need to play any midi events
-   if (queued_syncs.size() > 0 && queued_syncs.front().first < current_time) {
-
-      // Play the midi data
+   // Check to see if we need to respond to any syncs
+   while (queued_syncs.size() > 0 &&
+         queued_syncs.front().first <= current_time) {
       send_sync_ack(queued_syncs.front().second);
    }
 }
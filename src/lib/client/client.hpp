@@ -3,20 +3,47 @@
 
 #include <stdint.h>
 #include <sys/time.h>
+#include <bitset>
 #include <deque>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include <cstdlib>
+#include "network/midi_codec.hpp"
 #include "network/network.hpp"
+#include "network/reactor.hpp"
+#include "network/timer.hpp"
 #include "portmidi/include/portmidi.h"
 #include "portmidi/include/porttime.h"
 
 #define INPUT_ARG_COUNT 4
+#define MAX_INPUT_ARG_COUNT 5
 #define MAX_TIMEOUTS 5
+#define OUTPUT_BUFFER_SIZE 1024 // Events PortMidi can hold when scheduling.
+#define MAX_WRITE_BATCH 64    // Most events handed to Pm_Write at once.
+#define SEQ_WINDOW 256        // Span of sequence numbers checked for
+                              // duplicate midi messages.
+#define FEC_HISTORY 64        // Midi messages kept around for rebuilding
+                              // lost ones from parity.
+#define SYSEX_TIMEOUT_MS 10000 // How long (ms) a system exclusive message
+                              // is remembered after its last fragment.
 
 namespace client {
    enum Client_State { HANDSHAKE, TWIDDLE, PLAY, DONE };
 };
 
+// A system exclusive message whose MIDI_SYSEX fragments are still coming in,
+// or that was queued to play and whose resent fragments still need acks.
+typedef struct PartialSysex {
+   std::vector<uint8_t> data;    // The message, as far as it got.
+   uint32_t total_len;           // Length of the whole message.
+   uint32_t received;            // Bytes of it received so far.
+   std::set<uint32_t> offsets;   // Offsets of the fragments received.
+   bool queued;                  // True once it is all in and queued to play.
+   nsec_t last_fragment;         // When its last new fragment came in.
+} PartialSysex;
+
 // Function for seperate PortMidi thread to call to update timestamps within the
 // client object.
 void process_midi(PtTimestamp timestamp, void *userData);
@@ -35,33 +62,76 @@ class Client {
       fd_set rdfds;                 // Set of fds to select on.
       struct timeval tv;            // Timeval for select.
       uint8_t timeout_count;        // # times select has timed out in a row.
+      Reactor reactor;              // Event loop for stdin and the socket.
+      Timer timer;                  // Goes off when the next queued item is due.
+      bool stdin_open;              // False once stdin hits EOF.
 
       long delay;                   // Simulated network delay
-      long current_time;            // A variable to hold the current time.
+      nsec_t current_time;          // A variable to hold the current time.
       long timing_checkpoint;       // Used for timing keyboard events.
       int midi_channel;             // Target midi channel to play out of
+      long output_latency;          // PortMidi latency (ms), 0 plays events
+                                    // the moment they are written.
       int client_alive;             // For simulating a dead client
+      int loss_percent;             // Simulated packet loss (%) on midi
+                                    // messages and their acks.
+
+      bool clock_synced;            // True once clock_offset is usable.
+      nsec_t clock_offset;          // Client's clock minus the server's clock
+      nsec_t offset_time;           // as of offset_time (server's clock).
+      double clock_skew;            // Drift of clock_offset (ns per ns).
+
+      // Newest midi message sequence number received, and which of the
+      // SEQ_WINDOW numbers before it were received too (bit n is newest_seq
+      // - n), so resent messages are only played once.
+      bool seq_seen;
+      uint32_t newest_seq;
+      std::bitset<SEQ_WINDOW> seen_seqs;
 
       uint8_t buf[MAX_BUF_SIZE];    // Buffer used for message handling.
 
       PortMidiStream *stream;       // Pointer to the port midi output stream.
       int default_device_id;        // Default device id for this midi device.
-      Packet_Header *midi_header;   // Header pointer for overlaying on midi messages.
+      Packet_Header midi_header;    // Header decoded from the last received packet.
       Packet_Header midi_ack;       // Structure used for acking midi messages.
       PmMessage message;            // Message to receive midi into.
       PmEvent event;                // Event to play the midi message.
+      PmEvent events[MAX_WRITE_BATCH]; // Events written to PortMidi at once.
       MyPmEvent *my_event;          // Event to send to output midi device.
+      uint8_t midi_format;          // Wire format the server's midi events
+                                    // are in, agreed on in the handshake.
+      MidiDecoder decoder;          // Reads the events of midi messages.
 
       // Queue of midi events to play and their timestamps (this is used if
-      // delay is non-zero to simulate network delay on the initial trip).
-      std::deque<std::pair<long, MyPmEvent> > queued_events;
+      // delay is non-zero to simulate network delay on the initial trip, and
+      // to hold MIDI_TIMED events until their play time). Kept sorted by
+      // timestamp.
+      std::deque<std::pair<nsec_t, MyPmEvent> > queued_events;
+
+      // Queue of system exclusive messages to play and when, kept sorted the
+      // same way.
+      std::deque<std::pair<nsec_t, std::vector<uint8_t> > > queued_sysex;
+
+      // System exclusive messages being put back together, keyed by the
+      // sequence number of their first fragment. Entries are forgotten
+      // SYSEX_TIMEOUT_MS after their last new fragment.
+      std::map<uint32_t, PartialSysex> partial_sysex;
 
-      // Queue of sequence numbers of packets to ack and their timestamps (this
-      // is used if the delay is non-zerot o simulate network delay on the
-      // return trip).
-      std::deque<std::pair<long, uint32_t> > queued_acks;
+      // Queue of acks of packets and their timestamps (this is used if the
+      // delay is non-zerot o simulate network delay on the return trip).
+      std::deque<std::pair<nsec_t, Packet_Header> > queued_acks;
 
-      std::deque<std::pair<long, uint32_t> > queued_syncs;
+      // The most recent midi messages received, by sequence number, for
+      // rebuilding a lost message from a parity message.
+      std::deque<std::pair<uint32_t, std::vector<uint8_t> > > recent_packets;
+
+      // Queue of sync packets to respond to and their timestamps (this is
+      // used if the delay is non-zero to simulate network delay).
+      std::deque<std::pair<nsec_t, Sync_Packet> > queued_syncs;
+
+      // Arms the timer for whichever queued event, ack or sync is due first,
+      // or disarms it if nothing is queued.
+      void arm_timer();
 
       // Clear all queues for the client
       void clear_queues();
@@ -85,26 +155,61 @@ class Client {
       // Handles the exit message from the server, closing the client.
       void handle_done();
 
+      // Returns false if the midi message seq_num was already received (or
+      // is too old to tell), marking it as received.
+      bool first_delivery(uint32_t seq_num);
+
+      // Drops the partial_sysex entries that haven't had a new fragment in
+      // SYSEX_TIMEOUT_MS.
+      void forget_stale_sysex();
+
       // Handles the setup of the client with the server.
       void handle_handshake();
 
+      // Acks and queues the len byte midi message in buf, unless it was
+      // already received. Messages rebuilt from parity are recovered.
+      void handle_midi_msg(uint32_t len, bool recovered);
+
+      // Rebuilds the one midi message the len byte parity message in buf
+      // covers that never showed up, if only one is missing.
+      void handle_parity_msg(uint32_t len);
+
+      // Receives and handles a packet from the server.
+      void handle_server_msg();
+
       // Handle input from stdin
       void handle_stdin();
 
       // Initialize all values needed by the client
       void init();
 
-      // Parses the midi data sent to the client from the server.
-      void queue_midi_data();
+      // Parses the midi data in the len byte message sent to the client from
+      // the server.
+      void queue_midi_data(uint32_t len);
+
+      // Queues the event to be played at play_time, keeping the queue sorted.
+      void queue_midi_event(nsec_t play_time, MyPmEvent *event);
+
+      // Files the MIDI_SYSEX fragment in the len byte message in buf, queueing
+      // the system exclusive message to be played once all of it is in.
+      // Returns true if the fragment is stored (now or before), which is when
+      // it may be acked.
+      bool queue_sysex_fragment(uint32_t len);
+
+      // Parses the len byte message of midi data sent ahead of time, queueing
+      // each event to be played at the time the server asked for (in the
+      // client's clock).
+      void queue_timed_midi_data(uint32_t len);
 
       // Handles the playing of the song's midi events from the server.
       void handle_play();
 
       // Handles sync messages between the client and the server.
-      void queue_sync();
+      void queue_sync(uint32_t len);
 
-      // Parses a handshake ack, returning its flag.
-      flag::Packet_Flag parse_handshake_ack();
+      // Parses the len byte handshake ack, returning its flag and picking up
+      // the midi format the server is going to send.
+      flag::Packet_Flag parse_handshake_ack(uint32_t len);
 
       // Parses a list of arguments which correspond to the required
       // configuration options for the client class. If any errors are
@@ -113,16 +218,23 @@ class Client {
 
       // Plays any events that are ready to go (based on the delay). This
       // enforces the simulated front side latency (which goes away if delay is
-      // set to 0).
+      // set to 0). With an output latency, events are instead handed to
+      // PortMidi in batches up to output_latency ms ahead of time, stamped
+      // with when to play them, and PortMidi does the precise scheduling.
       void play_midi_data();
 
+      // Returns true if a queued event or system exclusive message plays by
+      // horizon.
+      bool play_due(nsec_t horizon);
+
       // Prints the usage message specifying the input arguments to the client
       // constructor.
       void print_usage();
 
       // Adds the current sequence number and current timestamp to the queue of
-      // acks which will later be dispatched after delay amount of time.
-      void queue_midi_ack(uint32_t packet_seq_num);
+      // acks which will later be dispatched after delay amount of time. Acks
+      // of messages rebuilt from parity are marked as recovered.
+      void queue_midi_ack(uint32_t packet_seq_num, bool recovered);
 
       // Drops the client into the state machine to connect with the server and
       // play a song.
@@ -141,13 +253,15 @@ class Client {
       // ready to go!
       void send_handshake_fin();
 
-      // Increments the sequence number and sends an ack to the server for a
-      // midi message.
-      void send_midi_ack(uint32_t packet_seq_num);
+      // Sends the ack at the front of the queue to the server for a midi
+      // message.
+      void send_midi_ack(Packet_Header& ack);
 
       // Sends a sync message to the server after delay amount of time to
-      // simulate latency in the network.
-      void send_sync_ack(uint32_t packet_seq_num);
+      // simulate latency in the network, stamping when the sync arrived and
+      // left so the server can work out our clock offset. Picks up the
+      // server's latest estimate of that offset along the way.
+      void send_sync_ack(Sync_Packet& sync);
 
       // Sets tv to have timeout seconds.
       void set_timeval(uint32_t timeout);
@@ -155,8 +269,26 @@ class Client {
       // Sets up the client's socket to connect to the server on.
       void setup_udp_socket();
 
+      // Returns true if the midi message seq_num was received (or is too
+      // old to tell).
+      bool seq_received(uint32_t seq_num);
+
+      // Returns true if the simulated packet loss claims a packet.
+      bool simulate_loss();
+
+      // Returns true if the next thing to play is a system exclusive message,
+      // which goes ahead of any event due at the same time.
+      bool sysex_next();
+
+      // Translates a time on the server's clock into the client's clock,
+      // accounting for how far the clocks have drifted since the offset
+      // between them was measured.
+      nsec_t to_local_time(nsec_t server_time);
+
       // Handles the waiting state of the client when it is sitting around for
-      // instructions from the server.
+      // instructions from the server. Blocks until a packet or stdin shows up
+      // or the timer says something queued is due, then sends whatever acks
+      // and plays whatever events are due.
       void twiddle();
 
    public:
@@ -127,6 +127,8 @@ class MidiFile {
       void      doTimeAnalysis            (void);
       double    getTimeInSeconds          (int aTrack, int anIndex);
       double    getTimeInSeconds          (int tickvalue);
+      void      getTrackTimesInSeconds    (int aTrack,
+                                           vector<double>& seconds);
       int       getAbsoluteTickTime       (double starttime);
 
       double    getTotalTimeInSeconds     (void);
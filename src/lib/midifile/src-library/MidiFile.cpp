@@ -2133,6 +2133,69 @@ double MidiFile::getTotalTimeInQuarters(void) {
 
 
 
+//////////////////////////////
+//
+// MidiFile::getTrackTimesInSeconds -- fill seconds with the time in
+//     seconds of every event in the given track.  The events and the
+//     time map are both sorted by tick, so they are walked in lockstep
+//     instead of searching the time map once per event, which makes
+//     the whole track linear in the number of events plus tempo map
+//     entries.  The values match calling getTimeInSeconds() on each
+//     event (-1.0 for ticks outside of the time map).
+//
+
+void MidiFile::getTrackTimesInSeconds(int aTrack, vector<double>& seconds) {
+   // Building the time map joins and splits the tracks, so only look at
+   // the track once the map is built.
+   if (timemapvalid == 0) {
+      buildTimeMap();
+      if (timemapvalid == 0) {
+         seconds.assign(getEventCount(aTrack), -1.0);    // something went wrong
+         return;
+      }
+   }
+
+   MidiEventList& track = *events[aTrack];
+   int count = track.size();
+   seconds.resize(count);
+
+   int absolute = isAbsoluteTicks();
+   int mapsize = (int)timemap.size();
+   int m = 0;
+   int tick = 0;
+
+   for (int i=0; i<count; i++) {
+      if (absolute) {
+         tick = track[i].tick;
+      } else {
+         tick += track[i].tick;
+      }
+
+      // Events should come in tick order, but start the sweep over if
+      // one jumps backwards so the result is still right.
+      if (tick < timemap[m].tick) {
+         m = 0;
+      }
+      while ((m < mapsize-1) && (timemap[m+1].tick <= tick)) {
+         m++;
+      }
+
+      if (timemap[m].tick == tick) {
+         seconds[i] = timemap[m].seconds;
+      } else if ((tick < timemap[m].tick) || (m >= mapsize-1)) {
+         seconds[i] = -1.0;   // don't try to extrapolate
+      } else {
+         double x1 = timemap[m].tick;
+         double x2 = timemap[m+1].tick;
+         double y1 = timemap[m].seconds;
+         double y2 = timemap[m+1].seconds;
+         seconds[i] = (tick-x1) * ((y2-y1)/(x2-x1)) + y1;
+      }
+   }
+}
+
+
+
 //////////////////////////////
 //
 // MidiFile::doTimeAnalysis -- Identify the real-time position of
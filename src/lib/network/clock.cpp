@@ -0,0 +1,91 @@
+#include <time.h>             // clock_gettime
+#include "network/clock.hpp"
+#include "network/network.hpp"
+
+#if defined(TSC_CLOCK) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>            // __get_cpuid
+#include <x86intrin.h>        // __rdtsc
+#define HAVE_TSC
+#endif
+
+// Reads the monotonic clock the kernel keeps.
+static nsec_t monotonic_now() {
+   struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+   ASSERT(clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0);
+#else
+   ASSERT(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+#endif
+   return (nsec_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+#ifdef HAVE_TSC
+
+// Where the time stamp counter and the monotonic clock lined up, and how many
+// nanoseconds a tick of the counter is worth.
+typedef struct TscCalibration {
+   bool usable;         // False if the TSC can't be trusted as a clock.
+   uint64_t base_ticks; // TSC reading at base_ns.
+   nsec_t base_ns;      // Monotonic clock reading at base_ticks.
+   double ns_per_tick;  // Length of a TSC tick.
+} TscCalibration;
+
+// Measures the TSC against the monotonic clock. Only CPUs whose TSC ticks at
+// a constant rate through frequency and sleep state changes are used.
+static TscCalibration calibrate_tsc() {
+   TscCalibration calibration;
+   unsigned int eax, ebx, ecx, edx;
+   uint64_t end_ticks;
+   nsec_t end_ns;
+
+   calibration.usable = false;
+   if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+         !(edx & (1 << 8))) {
+      fprintf(stderr, "No invariant TSC, using the monotonic clock.\n");
+      return calibration;
+   }
+
+   calibration.base_ns = monotonic_now();
+   calibration.base_ticks = __rdtsc();
+   do {
+      end_ns = monotonic_now();
+      end_ticks = __rdtsc();
+   } while (end_ns - calibration.base_ns < TSC_CALIBRATION_NS);
+
+   calibration.ns_per_tick = (double)(end_ns - calibration.base_ns) /
+      (double)(end_ticks - calibration.base_ticks);
+   calibration.usable = true;
+   return calibration;
+}
+
+// Calibrated the first time the clock is read (thread safe in C++11).
+static const TscCalibration& tsc() {
+   static const TscCalibration calibration = calibrate_tsc();
+   return calibration;
+}
+
+nsec_t clock_now() {
+   const TscCalibration& calibration = tsc();
+   if (!calibration.usable) {
+      return monotonic_now();
+   }
+
+   return calibration.base_ns + (nsec_t)((double)(__rdtsc() -
+            calibration.base_ticks) * calibration.ns_per_tick);
+}
+
+bool clock_uses_tsc() {
+   return tsc().usable;
+}
+
+#else
+
+nsec_t clock_now() {
+   return monotonic_now();
+}
+
+bool clock_uses_tsc() {
+   return false;
+}
+
+#endif
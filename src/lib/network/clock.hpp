@@ -0,0 +1,41 @@
+#ifndef __CLOCK__HPP__
+#define __CLOCK__HPP__
+
+#include <stdint.h>
+
+// A point in time on (or a span of) the monotonic clock, in nanoseconds.
+typedef int64_t nsec_t;
+
+#define NSEC_PER_USEC ((nsec_t)1000)        // Nanoseconds in a microsecond.
+#define NSEC_PER_MSEC ((nsec_t)1000000)     // Nanoseconds in a millisecond.
+#define NSEC_PER_SEC  ((nsec_t)1000000000)  // Nanoseconds in a second.
+
+#define TSC_CALIBRATION_NS ((nsec_t)20000000) // How long the TSC is measured
+                                              // against the monotonic clock.
+
+// Returns the current time on the monotonic clock. This is
+// CLOCK_MONOTONIC_RAW (immune to NTP steps and slewing) where there is one.
+// Building with -DTSC_CLOCK reads the CPU's time stamp counter instead, scaled
+// by a calibration against the monotonic clock taken on first use, provided
+// the CPU has an invariant TSC.
+nsec_t clock_now();
+
+// Returns true if clock_now() is reading the time stamp counter.
+bool clock_uses_tsc();
+
+// Converts between milliseconds and nanoseconds. Nanoseconds round down.
+inline nsec_t msec_to_nsec(long milliseconds) {
+   return (nsec_t)milliseconds * NSEC_PER_MSEC;
+}
+
+inline long nsec_to_msec(nsec_t nanoseconds) {
+   return (long)(nanoseconds / NSEC_PER_MSEC);
+}
+
+// Converts a span of nanoseconds to milliseconds, rounding up so that
+// sleeping for the result never wakes up early.
+inline long nsec_to_msec_ceil(nsec_t nanoseconds) {
+   return (long)((nanoseconds + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include "network/midi_codec.hpp"
+#include "network/wire.hpp"
+
+// Returns true if the status changes what running status the next event may
+// use. Channel messages set it and system common messages cancel it, but
+// real time messages can be slipped in without disturbing it.
+static bool sets_running_status(uint8_t status) {
+   return status < 0xF8;
+}
+
+MidiEncoder::MidiEncoder() {
+   reset(midi_format::FIXED);
+}
+
+uint32_t MidiEncoder::encode(const MyPmEvent& event, uint8_t *buf) {
+   uint8_t status = event.message[0];
+   uint32_t num_data;
+   uint32_t zigzag;
+   int32_t delta;
+   uint32_t len = 0;
+
+   if (format == midi_format::FIXED) {
+      event.serialize(buf, 0);
+      return SIZEOF_MIDI_EVENT;
+   }
+
+   // Events in a message are nearly in order, so the change in timestamp is
+   // small but may be negative. Zigzag keeps small negatives small.
+   delta = (int32_t)(event.timestamp - last_timestamp);
+   zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+   last_timestamp = event.timestamp;
+   while (zigzag >= 0x80) {
+      buf[len++] = (uint8_t)(zigzag | 0x80);
+      zigzag >>= 7;
+   }
+   buf[len++] = (uint8_t)zigzag;
+
+   if (status != running_status) {
+      buf[len++] = status;
+   }
+   if (sets_running_status(status)) {
+      running_status = status < 0xF0 ? status : 0;
+   }
+
+   num_data = midi_data_bytes(status);
+   for (uint32_t i = 1; i <= num_data; ++i) {
+      buf[len++] = event.message[i];
+   }
+
+   return len;
+}
+
+void MidiEncoder::reset(uint8_t format) {
+   this->format = format;
+   running_status = 0;
+   last_timestamp = 0;
+}
+
+MidiDecoder::MidiDecoder() {
+   reset(midi_format::FIXED);
+}
+
+bool MidiDecoder::decode(const uint8_t *buf, uint32_t len, uint32_t *offset,
+      MyPmEvent *event) {
+   uint32_t at = *offset;
+   uint32_t zigzag = 0;
+   uint32_t num_data;
+   int32_t delta;
+   uint8_t status;
+
+   if (format == midi_format::FIXED) {
+      if (at + SIZEOF_MIDI_EVENT > len) {
+         return false;
+      }
+      event->message[0] = buf[at];
+      event->message[1] = buf[at + 1];
+      event->message[2] = buf[at + 2];
+      event->timestamp = load_le32(buf + at + 3);
+      *offset = at + SIZEOF_MIDI_EVENT;
+      return true;
+   }
+
+   for (uint32_t shift = 0; ; shift += 7) {
+      if (at >= len || shift > 28) {
+         return false;
+      }
+      zigzag |= (uint32_t)(buf[at] & 0x7F) << shift;
+      if ((buf[at++] & 0x80) == 0) {
+         break;
+      }
+   }
+   delta = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+   last_timestamp += (uint32_t)delta;
+   event->timestamp = last_timestamp;
+
+   if (at >= len) {
+      return false;
+   }
+
+   // A data byte where the status should be means running status.
+   if (buf[at] & 0x80) {
+      status = buf[at++];
+   }
+   else if (running_status != 0) {
+      status = running_status;
+   }
+   else {
+      return false;
+   }
+   if (sets_running_status(status)) {
+      running_status = status < 0xF0 ? status : 0;
+   }
+
+   num_data = midi_data_bytes(status);
+   if (at + num_data > len) {
+      return false;
+   }
+   event->message[0] = status;
+   event->message[1] = 0;
+   event->message[2] = 0;
+   for (uint32_t i = 1; i <= num_data; ++i) {
+      event->message[i] = buf[at++];
+   }
+
+   *offset = at;
+   return true;
+}
+
+void MidiDecoder::reset(uint8_t format) {
+   this->format = format;
+   running_status = 0;
+   last_timestamp = 0;
+}
+
+uint32_t midi_data_bytes(uint8_t status) {
+   switch (status & 0xF0) {
+      case 0xC0:              // Program change
+      case 0xD0:              // Channel pressure
+         return 1;
+      case 0xF0:
+         break;
+      default:
+         return 2;
+   }
+
+   switch (status) {
+      case 0xF1:              // Time code quarter frame
+      case 0xF3:              // Song select
+         return 1;
+      case 0xF6:              // Tune request
+         return 0;
+      default:
+         // Real time messages have no data, anything else the fixed format
+         // could carry keeps both of its bytes.
+         return status >= 0xF8 ? 0 : 2;
+   }
+}
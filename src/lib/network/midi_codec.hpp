@@ -0,0 +1,58 @@
+#ifndef __MIDI_CODEC__HPP__
+#define __MIDI_CODEC__HPP__
+
+#include <stdint.h>
+#include "network/network.hpp"
+
+#define MAX_ENCODED_EVENT 8   // Most bytes any wire format spends on an event
+                              // (a 5 byte varint, a status and 2 data bytes).
+
+// Writes the midi events of a MIDI or MIDI_TIMED message in the wire format
+// agreed on in the handshake. The fixed format is the 7 byte MyPmEvent. The
+// compact format writes each event as the change in timestamp since the
+// message's previous event (a zigzag varint), the status byte unless it
+// repeats the previous channel message's (running status), and only as many
+// data bytes as the status calls for. Events must start with a status byte.
+class MidiEncoder {
+   private:
+      uint8_t format;               // Wire format being written.
+      uint8_t running_status;       // Status the next event may leave out
+                                    // (0 if none).
+      uint32_t last_timestamp;      // Timestamp of the previous event.
+
+   public:
+      MidiEncoder();
+
+      // Starts a new message in the given wire format.
+      void reset(uint8_t format);
+
+      // Writes the event at buf and returns the number of bytes written, at
+      // most MAX_ENCODED_EVENT.
+      uint32_t encode(const MyPmEvent& event, uint8_t *buf);
+};
+
+// Reads back the midi events a MidiEncoder wrote, in the same order.
+class MidiDecoder {
+   private:
+      uint8_t format;               // Wire format being read.
+      uint8_t running_status;       // Status of events that leave it out (0
+                                    // if none).
+      uint32_t last_timestamp;      // Timestamp of the previous event.
+
+   public:
+      MidiDecoder();
+
+      // Starts reading a new message in the given wire format.
+      void reset(uint8_t format);
+
+      // Reads the event at buf + *offset into event and moves *offset past
+      // it. Returns false if the event runs past the len bytes of buf or
+      // makes no sense, in which case the rest of the message can't be read.
+      bool decode(const uint8_t *buf, uint32_t len, uint32_t *offset,
+            MyPmEvent *event);
+};
+
+// Returns the number of data bytes that follow a midi status byte.
+uint32_t midi_data_bytes(uint8_t status);
+
+#endif
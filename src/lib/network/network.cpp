@@ -3,11 +3,221 @@
 #include <string.h>
 #include <iostream>
 #include <cstdarg>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <stdio.h>
 #include "network/network.hpp"
 
+SendBatch::SendBatch(uint32_t capacity) {
+   this->capacity = capacity;
+   if (this->capacity > MAX_SEND_BATCH) {
+      this->capacity = MAX_SEND_BATCH;
+   }
+   if (this->capacity == 0) {
+      this->capacity = 1;
+   }
+   count = 0;
+}
+
+SendBatch::~SendBatch() {
+}
+
+void SendBatch::clear() {
+   count = 0;
+}
+
+void SendBatch::commit(uint32_t len) {
+   ASSERT(count < capacity);
+   ASSERT(len <= MAX_BUF_SIZE);
+   packets[count].len = len;
+   packets[count].result = -1;
+   ++count;
+}
+
+bool SendBatch::full() {
+   return count >= capacity;
+}
+
+uint32_t SendBatch::flush() {
+   bool flushed[MAX_SEND_BATCH];
+   uint32_t num_sent = 0;
+
+   memset(flushed, 0, sizeof(flushed));
+
+   // Send every socket's datagrams together, in the order they were staged.
+   for (uint32_t i = 0; i < count; ++i) {
+      if (!flushed[i]) {
+         flush_sock(packets[i].sock, flushed);
+      }
+   }
+
+   for (uint32_t i = 0; i < count; ++i) {
+      if (packets[i].result == (int)packets[i].len) {
+         ++num_sent;
+      }
+   }
+
+   return num_sent;
+}
+
+#ifdef __linux__
+void SendBatch::flush_sock(int sock, bool *flushed) {
+   uint32_t index[MAX_SEND_BATCH];
+   uint32_t num_msgs = 0;
+   uint32_t offset = 0;
+   int result;
+
+   // Gather this socket's datagrams.
+   for (uint32_t i = 0; i < count; ++i) {
+      if (flushed[i] || packets[i].sock != sock) {
+         continue;
+      }
+
+      iovs[num_msgs].iov_base = packets[i].buf;
+      iovs[num_msgs].iov_len = packets[i].len;
+      memset(&msgs[num_msgs], '\0', sizeof(struct mmsghdr));
+      msgs[num_msgs].msg_hdr.msg_name = &packets[i].remote;
+      msgs[num_msgs].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msgs[num_msgs].msg_hdr.msg_iov = &iovs[num_msgs];
+      msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+      index[num_msgs] = i;
+      flushed[i] = true;
+      ++num_msgs;
+   }
+
+   // sendmmsg() stops at the first datagram that fails, so record the
+   // failure and carry on with the rest.
+   while (offset < num_msgs) {
+      result = sendmmsg(sock, msgs + offset, num_msgs - offset, 0);
+      if (result < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         packets[index[offset]].result = -1;
+         ++offset;
+         continue;
+      }
+
+      for (int i = 0; i < result; ++i) {
+         packets[index[offset + i]].result = msgs[offset + i].msg_len;
+      }
+      offset += result;
+   }
+}
+#else
+void SendBatch::flush_sock(int sock, bool *flushed) {
+   for (uint32_t i = 0; i < count; ++i) {
+      if (flushed[i] || packets[i].sock != sock) {
+         continue;
+      }
+
+      packets[i].result = send_buf(sock, &packets[i].remote, packets[i].buf,
+            packets[i].len);
+      flushed[i] = true;
+   }
+}
+#endif
+
+Batch_Packet *SendBatch::packet(uint32_t index) {
+   ASSERT(index < count);
+   return &packets[index];
+}
+
+uint32_t SendBatch::size() {
+   return count;
+}
+
+uint8_t *SendBatch::stage(int sock, sockaddr_in *remote, int tag) {
+   ASSERT(count < capacity);
+   ASSERT(remote != NULL);
+   packets[count].sock = sock;
+   packets[count].remote = *remote;
+   packets[count].tag = tag;
+   return packets[count].buf;
+}
+
+RecvBatch::RecvBatch(uint32_t capacity) {
+   this->capacity = capacity;
+   if (this->capacity > MAX_RECV_BATCH) {
+      this->capacity = MAX_RECV_BATCH;
+   }
+   if (this->capacity == 0) {
+      this->capacity = 1;
+   }
+   count = 0;
+}
+
+RecvBatch::~RecvBatch() {
+}
+
+bool RecvBatch::full() {
+   return count >= capacity;
+}
+
+Batch_Packet *RecvBatch::packet(uint32_t index) {
+   ASSERT(index < count);
+   return &packets[index];
+}
+
+#ifdef __linux__
+uint32_t RecvBatch::receive(int sock) {
+   int result;
+
+   for (uint32_t i = 0; i < capacity; ++i) {
+      iovs[i].iov_base = packets[i].buf;
+      iovs[i].iov_len = MAX_BUF_SIZE;
+      memset(&msgs[i], '\0', sizeof(struct mmsghdr));
+      msgs[i].msg_hdr.msg_name = &packets[i].remote;
+      msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   do {
+      result = recvmmsg(sock, msgs, capacity, MSG_DONTWAIT, NULL);
+   } while (result < 0 && errno == EINTR);
+
+   if (result < 0) {
+      ASSERT(errno == EAGAIN || errno == EWOULDBLOCK);
+      result = 0;
+   }
+
+   count = result;
+   for (uint32_t i = 0; i < count; ++i) {
+      packets[i].sock = sock;
+      packets[i].len = msgs[i].msg_len;
+      packets[i].result = msgs[i].msg_len;
+   }
+
+   return count;
+}
+#else
+uint32_t RecvBatch::receive(int sock) {
+   int result;
+
+   for (count = 0; count < capacity; ++count) {
+      result = recv_buf(sock, &packets[count].remote, packets[count].buf,
+            MAX_BUF_SIZE);
+      if (result < 0) {
+         ASSERT(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+         break;
+      }
+
+      packets[count].sock = sock;
+      packets[count].len = result;
+      packets[count].result = result;
+   }
+
+   return count;
+}
+#endif
+
+uint32_t RecvBatch::size() {
+   return count;
+}
+
 int send_buf(int sock, sockaddr_in *remote, uint8_t *buf, uint32_t buf_len) {
    socklen_t sockaddr_in_len = sizeof(sockaddr_in);
    return sendto(sock, buf, buf_len, 0, (const sockaddr*)remote,
@@ -20,11 +230,15 @@ int recv_buf(int sock, sockaddr_in *remote, uint8_t *buf, uint32_t buf_len) {
          &sockaddr_in_len);
 }
 
+void set_nonblocking(int sock) {
+   int flags = fcntl(sock, F_GETFL, 0);
+   ASSERT(flags >= 0);
+   ASSERT(fcntl(sock, F_SETFL, flags | O_NONBLOCK) >= 0);
+}
+
 void get_current_time(long *milliseconds) {
    // Get the current time.
-   struct timeval tp;
-   gettimeofday(&tp, NULL);
-   *milliseconds = tp.tv_sec * 1000 + tp.tv_usec / 1000;
+   *milliseconds = nsec_to_msec(clock_now());
 }
 
 void print_debug(const char *format, ...) {
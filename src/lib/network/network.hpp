@@ -4,7 +4,9 @@
 #include <netdb.h>   // sockaddr_in
 #include <stdint.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sstream>
+#include "network/clock.hpp"
 
 #define FALSE 0
 #define TRUE 1
@@ -15,6 +17,14 @@
 
 #define SIZEOF_MIDI_EVENT (3 * sizeof(uint8_t) + sizeof(uint32_t))
 #define MAX_BUF_SIZE 2048
+#define MAX_MIDI_PACKET 1472  // Largest midi message that fits in one
+                              // ethernet frame (1500 - IP and UDP headers).
+#define MAX_MIDI_EVENTS 255   // Most events num_midi_events can count.
+#define MAX_SEND_BATCH 64     // Most datagrams a SendBatch can hold.
+#define MAX_RECV_BATCH 64     // Most datagrams a RecvBatch reads at once.
+#define CACHE_LINE_SIZE 64    // Size of a cache line on the machines we run on.
+#define MAX_FEC_GROUP 8       // Most midi messages a parity message covers.
+#define MAX_SYSEX_LEN 1048576 // Longest system exclusive message sent.
 
 #define ASSERT(expression) {\
    if (!(expression)) {\
@@ -36,7 +46,14 @@
 
 namespace flag {
    enum Packet_Flag { BLANK, MIDI, MIDI_ACK, SONG_START, SONG_FIN, HS, HS_GOOD,
-      HS_FAIL, HS_FIN, SYNC, SYNC_ACK };
+      HS_FAIL, HS_FIN, SYNC, SYNC_ACK, MIDI_TIMED, MIDI_PARITY, FEC_ACK,
+      MIDI_SYSEX };
+};
+
+namespace midi_format {
+   // Wire formats of the midi events in MIDI and MIDI_TIMED messages (see
+   // MidiEncoder), newest last. SYSEX is COMPACT plus MIDI_SYSEX messages.
+   enum Midi_Format { FIXED, COMPACT, SYSEX, NEWEST = SYSEX };
 };
 
 typedef uint8_t MyPmMessage[3];
@@ -54,28 +71,199 @@ typedef struct MyPmEvent {
       timestamp = other.timestamp;
    }
 
-   void serialize(uint8_t *buf, uint64_t offset) {
+   // Writes the event in the fixed wire format, timestamp in little endian.
+   void serialize(uint8_t *buf, uint64_t offset) const {
       buf[offset++] = message[0];
       buf[offset++] = message[1];
       buf[offset++] = message[2];
-      memcpy(buf + offset, &timestamp, sizeof(uint32_t));
+      buf[offset++] = (uint8_t)timestamp;
+      buf[offset++] = (uint8_t)(timestamp >> 8);
+      buf[offset++] = (uint8_t)(timestamp >> 16);
+      buf[offset] = (uint8_t)(timestamp >> 24);
    }
 } __attribute__((packed)) MyPmEvent;
 
+// The packets below are never overlaid on a datagram, encode_packet() and
+// decode_packet() (see wire.hpp) move them on and off the wire a field at a
+// time in little endian. They are packed so their size is their size on the
+// wire.
 typedef struct Packet_Header {
    uint32_t seq_num;
    uint8_t flag;
    uint8_t num_midi_events;
 } __attribute__((packed)) Packet_Header;
 
+// The client's HS carries the newest midi format and protocol version it can
+// speak and the server's HS_GOOD the ones it is going to use. Clients whose
+// HS leaves them out get the fixed format and version 0 (which is version 1
+// from a little endian host).
 typedef struct Handeshake_Packet {
    Packet_Header header;
+   uint8_t midi_format;    // A midi_format::Midi_Format.
+   uint8_t version;        // Wire protocol version (see PROTOCOL_VERSION).
 } __attribute__((packed)) Handshake_Packet;
 
+// NTP style exchange the server uses to measure a client's delay and clock
+// offset. The server sends a SYNC stamped with t1, the client echoes it back
+// as a SYNC_ACK with t2 and t3 filled in, and the server stamps t4 when it
+// arrives. The SYNC also carries the server's latest estimate of the
+// client's clock offset (as of offset_time) and of how fast that offset is
+// drifting, so the client can translate the play times of MIDI_TIMED
+// messages into its own clock.
+typedef struct Sync_Packet {
+   Packet_Header header;
+   uint32_t sync_seq;      // Server's number for the exchange, echoed back.
+   int64_t t1;             // Server's clock (ns) when the SYNC was sent.
+   int64_t t2;             // Client's clock (ns) when the SYNC arrived.
+   int64_t t3;             // Client's clock (ns) when the SYNC_ACK was sent.
+   int64_t t4;             // Server's clock (ns) when the SYNC_ACK arrived.
+   int64_t clock_offset;   // Client's clock minus the server's clock (ns).
+   int64_t offset_time;    // Server's clock (ns) clock_offset was taken at.
+   int64_t skew_ppb;       // Drift of clock_offset in parts per billion.
+   uint8_t offset_valid;   // Nonzero once clock_offset has been measured.
+} __attribute__((packed)) Sync_Packet;
+
+// Header of a MIDI_TIMED message, which is followed by its midi events. Each
+// event is to be played once the server's clock reads base_time plus the
+// event's timestamp (which is in ms).
+typedef struct Timed_Midi_Header {
+   Packet_Header header;
+   int64_t base_time;      // Server's clock (ns) at the song's timestamp 0.
+} __attribute__((packed)) Timed_Midi_Header;
+
+// Header of a MIDI_PARITY message, which is followed by the XOR of the midi
+// messages it covers (headers and all), each padded with zeros to the length
+// of the longest one. A client missing any one of the covered messages can
+// rebuild it from the others and the parity, without waiting on a resend.
+// Rebuilt messages are acked with FEC_ACK instead of MIDI_ACK.
+typedef struct Parity_Header {
+   Packet_Header header;
+   uint8_t num_packets;                // Number of midi messages covered.
+   uint16_t len_xor;                   // XOR of their lengths.
+   uint32_t seq_nums[MAX_FEC_GROUP];   // Their sequence numbers.
+} __attribute__((packed)) Parity_Header;
+
+// Header of a MIDI_SYSEX message, which is followed by a fragment of a system
+// exclusive message (0xF0 through 0xF7). Fragments are acked and resent like
+// any midi message, and the client plays the system exclusive message once
+// all of its fragments are in, ahead of any event due at the same time.
+typedef struct Sysex_Header {
+   Packet_Header header;
+   uint32_t first_seq;     // seq_num of the message with the first fragment.
+   uint32_t total_len;     // Length of the whole system exclusive message.
+   uint32_t offset;        // Where this fragment goes in it.
+   int64_t base_time;      // Server's clock (ns) at the song's timestamp 0.
+   uint32_t timestamp;     // When to play it (ms after base_time).
+   uint8_t timed;          // Nonzero to play it at base_time + timestamp,
+                           // otherwise it plays once it is all in.
+} __attribute__((packed)) Sysex_Header;
+
+// A datagram in a SendBatch or RecvBatch along with the outcome of sending
+// it.
+typedef struct Batch_Packet {
+   int sock;                  // Socket the datagram goes out of / came in on.
+   sockaddr_in remote;        // Where the datagram is headed / came from.
+   uint8_t buf[MAX_BUF_SIZE]; // The datagram itself.
+   uint32_t len;              // Number of bytes used in buf.
+   int tag;                   // Caller's bookkeeping (ie. a client id).
+   int result;                // Bytes sent (or -1) once the batch is flushed.
+} Batch_Packet;
+
+// Collects datagrams so they can be sent with as few syscalls as possible.
+// On Linux every datagram bound for the same socket goes out in a single
+// sendmmsg() call, elsewhere they are sent one at a time.
+class SendBatch {
+   private:
+      Batch_Packet packets[MAX_SEND_BATCH];  // Staged datagrams.
+      uint32_t capacity;                     // Datagrams allowed per flush.
+      uint32_t count;                        // Datagrams staged so far.
+
+#ifdef __linux__
+      struct mmsghdr msgs[MAX_SEND_BATCH];   // sendmmsg() headers.
+      struct iovec iovs[MAX_SEND_BATCH];     // One iovec per datagram.
+#endif
+
+      // Sends every staged datagram bound for sock.
+      void flush_sock(int sock, bool *flushed);
+
+   public:
+      // Creates an empty batch which flushes after capacity datagrams (capped
+      // at MAX_SEND_BATCH).
+      SendBatch(uint32_t capacity);
+
+      ~SendBatch();
+
+      // Drops every staged datagram so the batch can be reused.
+      void clear();
+
+      // Finishes the datagram returned by the last stage() call, which used
+      // len bytes of its buffer.
+      void commit(uint32_t len);
+
+      // Returns the number of staged datagrams.
+      uint32_t size();
+
+      // Returns true if no more datagrams can be staged before a flush.
+      bool full();
+
+      // Sends every staged datagram, filling in each one's result, and
+      // returns the number which went out in full. The datagrams stay in the
+      // batch until clear() is called.
+      uint32_t flush();
+
+      // Returns the index'th staged datagram.
+      Batch_Packet *packet(uint32_t index);
+
+      // Reserves the next datagram and returns the buffer to build it in.
+      // The batch must not be full.
+      uint8_t *stage(int sock, sockaddr_in *remote, int tag);
+};
+
+// Reads every datagram waiting on a socket with as few syscalls as possible.
+// On Linux a single recvmmsg() call picks up to capacity datagrams at once,
+// elsewhere they are read one at a time.
+class RecvBatch {
+   private:
+      Batch_Packet packets[MAX_RECV_BATCH];  // Received datagrams.
+      uint32_t capacity;                     // Datagrams read per call.
+      uint32_t count;                        // Datagrams from the last call.
+
+#ifdef __linux__
+      struct mmsghdr msgs[MAX_RECV_BATCH];   // recvmmsg() headers.
+      struct iovec iovs[MAX_RECV_BATCH];     // One iovec per datagram.
+#endif
+
+   public:
+      // Creates a batch which reads up to capacity datagrams per call (capped
+      // at MAX_RECV_BATCH).
+      RecvBatch(uint32_t capacity);
+
+      ~RecvBatch();
+
+      // Returns true if the last receive() filled the batch, meaning there
+      // may be more datagrams waiting on the socket.
+      bool full();
+
+      // Returns the index'th datagram from the last receive().
+      Batch_Packet *packet(uint32_t index);
+
+      // Reads whatever is waiting on the (nonblocking) socket and returns the
+      // number of datagrams read, 0 if there was nothing to read.
+      uint32_t receive(int sock);
+
+      // Returns the number of datagrams from the last receive().
+      uint32_t size();
+};
+
 int send_buf(int sock, sockaddr_in *remote, uint8_t *buf, uint32_t buf_len);
 
 int recv_buf(int sock, sockaddr_in *remote, uint8_t *buf, uint32_t buf_len);
 
+// Puts the socket into nonblocking mode so it can be drained until EAGAIN.
+void set_nonblocking(int sock);
+
+// Sets milliseconds to the current time on the monotonic clock. Anything that
+// needs better than millisecond resolution should use clock_now().
 void get_current_time(long *milliseconds);
 
 void print_debug(const char *format, ...);
@@ -0,0 +1,108 @@
+#include <errno.h>            // errno
+#include <unistd.h>           // close
+#include "network/network.hpp"
+#include "network/reactor.hpp"
+
+#ifdef __linux__
+
+Reactor::Reactor() {
+   epoll_fd = epoll_create1(0);
+   ASSERT(epoll_fd >= 0);
+   num_ready = 0;
+}
+
+Reactor::~Reactor() {
+   close(epoll_fd);
+}
+
+bool Reactor::add_fd(int fd, bool edge_triggered) {
+   struct epoll_event event;
+   memset(&event, '\0', sizeof(event));
+   event.events = EPOLLIN;
+   if (edge_triggered) {
+      event.events |= EPOLLET;
+   }
+   event.data.fd = fd;
+
+   return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void Reactor::remove_fd(int fd) {
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int Reactor::wait(int timeout_ms) {
+   num_ready = epoll_wait(epoll_fd, events, MAX_REACTOR_EVENTS, timeout_ms);
+
+   // A signal (ie. the PortTime thread being set up) is not an error, it just
+   // means nothing is ready yet.
+   if (num_ready < 0 && errno == EINTR) {
+      num_ready = 0;
+   }
+   ASSERT(num_ready >= 0);
+
+   return num_ready;
+}
+
+int Reactor::ready_fd(int index) {
+   ASSERT(index >= 0 && index < num_ready);
+   return events[index].data.fd;
+}
+
+#else
+
+Reactor::Reactor() {
+   num_ready = 0;
+}
+
+Reactor::~Reactor() {
+}
+
+bool Reactor::add_fd(int fd, bool edge_triggered) {
+   // poll() is always level triggered, which is a superset of what edge
+   // triggered callers expect since they drain the fd anyways.
+   struct pollfd pfd;
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+   poll_fds.push_back(pfd);
+   return true;
+}
+
+void Reactor::remove_fd(int fd) {
+   std::vector<struct pollfd>::iterator it;
+   for (it = poll_fds.begin(); it != poll_fds.end(); ++it) {
+      if (it->fd == fd) {
+         poll_fds.erase(it);
+         return;
+      }
+   }
+}
+
+int Reactor::wait(int timeout_ms) {
+   ready_fds.clear();
+
+   int result = poll(poll_fds.data(), poll_fds.size(), timeout_ms);
+   if (result < 0 && errno == EINTR) {
+      result = 0;
+   }
+   ASSERT(result >= 0);
+
+   std::vector<struct pollfd>::iterator it;
+   for (it = poll_fds.begin(); it != poll_fds.end() &&
+         ready_fds.size() < MAX_REACTOR_EVENTS; ++it) {
+      if (it->revents & (POLLIN | POLLHUP | POLLERR)) {
+         ready_fds.push_back(it->fd);
+      }
+   }
+
+   num_ready = ready_fds.size();
+   return num_ready;
+}
+
+int Reactor::ready_fd(int index) {
+   ASSERT(index >= 0 && index < num_ready);
+   return ready_fds[index];
+}
+
+#endif
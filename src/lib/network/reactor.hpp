@@ -0,0 +1,50 @@
+#ifndef __REACTOR__HPP__
+#define __REACTOR__HPP__
+
+#include <vector>
+
+#ifdef __linux__
+#include <sys/epoll.h>        // epoll_create1, epoll_ctl, epoll_wait
+#else
+#include <poll.h>             // poll
+#endif
+
+#define MAX_REACTOR_EVENTS 64 // Max number of ready fds reported per wakeup.
+
+// Event loop helper for the server and the clients. Fds are registered once
+// and then the caller blocks in wait() until one of them is readable or the
+// timeout expires. Backed by epoll on Linux and poll() everywhere else.
+class Reactor {
+   private:
+#ifdef __linux__
+      int epoll_fd;                                // The epoll instance.
+      struct epoll_event events[MAX_REACTOR_EVENTS]; // Ready events.
+#else
+      std::vector<struct pollfd> poll_fds;         // Registered fds.
+      std::vector<int> ready_fds;                  // Fds ready after wait().
+#endif
+      int num_ready;              // Number of ready fds from the last wait().
+
+   public:
+      Reactor();
+
+      ~Reactor();
+
+      // Registers fd for read readiness. Edge triggered fds are only reported
+      // when new data shows up, so they must be nonblocking and the caller
+      // must drain them until EAGAIN. Returns false if the fd can't be
+      // watched (ie. stdin redirected from a regular file).
+      bool add_fd(int fd, bool edge_triggered);
+
+      // Stops watching the fd.
+      void remove_fd(int fd);
+
+      // Blocks for at most timeout_ms milliseconds (-1 blocks forever) and
+      // returns the number of ready fds.
+      int wait(int timeout_ms);
+
+      // Returns the index'th ready fd from the last call to wait().
+      int ready_fd(int index);
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include <errno.h>            // errno
+#include <stdint.h>
+#include <unistd.h>           // close, read
+#include <algorithm>
+#include "network/network.hpp"
+#include "network/timer.hpp"
+
+#ifdef __linux__
+
+Timer::Timer() {
+   // clock_now() is CLOCK_MONOTONIC_RAW (or the TSC), which timerfds can't
+   // run off, so deadlines are turned into spans on CLOCK_MONOTONIC. The two
+   // only drift apart by NTP's slewing, which is negligible over a span.
+   timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   ASSERT(timer_fd >= 0);
+   armed = false;
+   deadline = 0;
+}
+
+Timer::~Timer() {
+   close(timer_fd);
+}
+
+void Timer::arm(nsec_t deadline) {
+   struct itimerspec spec;
+   nsec_t span;
+
+   // Don't bother the kernel if the timer is already set for this deadline.
+   if (armed && this->deadline == deadline) {
+      return;
+   }
+
+   // An all zero it_value disarms the timer, so deadlines that already
+   // passed go off a nanosecond from now.
+   span = std::max(deadline - clock_now(), (nsec_t)1);
+   memset(&spec, '\0', sizeof(spec));
+   spec.it_value.tv_sec = span / NSEC_PER_SEC;
+   spec.it_value.tv_nsec = span % NSEC_PER_SEC;
+
+   ASSERT(timerfd_settime(timer_fd, 0, &spec, NULL) == 0);
+   armed = true;
+   this->deadline = deadline;
+}
+
+void Timer::clear() {
+   uint64_t expirations;
+   if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+      EXCEPT(errno == EAGAIN || errno == EWOULDBLOCK, {});
+   }
+   armed = false;
+}
+
+void Timer::disarm() {
+   struct itimerspec spec;
+
+   if (!armed) {
+      return;
+   }
+
+   memset(&spec, '\0', sizeof(spec));
+   ASSERT(timerfd_settime(timer_fd, 0, &spec, NULL) == 0);
+   armed = false;
+}
+
+int Timer::fd() {
+   return timer_fd;
+}
+
+int Timer::wait_timeout() {
+   // The timerfd wakes the reactor up itself.
+   return -1;
+}
+
+#else
+
+Timer::Timer() {
+   timer_fd = -1;
+   armed = false;
+   deadline = 0;
+}
+
+Timer::~Timer() {
+}
+
+void Timer::arm(nsec_t deadline) {
+   armed = true;
+   this->deadline = deadline;
+}
+
+void Timer::clear() {
+   armed = false;
+}
+
+void Timer::disarm() {
+   armed = false;
+}
+
+int Timer::fd() {
+   return timer_fd;
+}
+
+int Timer::wait_timeout() {
+   nsec_t now;
+
+   if (!armed) {
+      return -1;
+   }
+
+   now = clock_now();
+   return deadline > now ? (int)nsec_to_msec_ceil(deadline - now) : 0;
+}
+
+#endif
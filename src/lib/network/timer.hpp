@@ -0,0 +1,43 @@
+#ifndef __TIMER__HPP__
+#define __TIMER__HPP__
+
+#ifdef __linux__
+#include <sys/timerfd.h>      // timerfd_create, timerfd_settime
+#endif
+#include "network/clock.hpp"
+
+// One shot timer that can be watched by a Reactor alongside sockets. On Linux
+// it is a timerfd that becomes readable once the deadline passes, elsewhere
+// it just remembers the deadline and hands the time left to it to the
+// reactor as its wait timeout. Deadlines are clock_now() times.
+class Timer {
+   private:
+      int timer_fd;                 // The timerfd (-1 if there isn't one).
+      bool armed;                   // True if a deadline is set.
+      nsec_t deadline;              // When the timer goes off.
+
+   public:
+      Timer();
+
+      ~Timer();
+
+      // Sets the timer to go off at the deadline, replacing any earlier one.
+      // Deadlines in the past go off right away.
+      void arm(nsec_t deadline);
+
+      // Acknowledges the timer going off so its fd stops being readable.
+      void clear();
+
+      // Cancels the deadline, if any.
+      void disarm();
+
+      // Returns the fd to register with a Reactor, or -1 if the timer has no
+      // fd and wait_timeout() must be used instead.
+      int fd();
+
+      // Returns how long (ms) a Reactor may block before the timer needs
+      // attention, -1 if it can block forever.
+      int wait_timeout();
+};
+
+#endif
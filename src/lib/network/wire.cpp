@@ -0,0 +1,147 @@
+#include "network/wire.hpp"
+
+// Writes the header's fields, which lead every packet.
+static void write_header(WireWriter& out, const Packet_Header& header) {
+   out.u32(header.seq_num);
+   out.u8(header.flag);
+   out.u8(header.num_midi_events);
+}
+
+static void read_header(WireReader& in, Packet_Header *header) {
+   header->seq_num = in.u32();
+   header->flag = in.u8();
+   header->num_midi_events = in.u8();
+}
+
+uint32_t encode_packet(const Packet_Header& header, uint8_t *buf,
+      uint32_t buf_len) {
+   WireWriter out(buf, buf_len);
+   write_header(out, header);
+   return out.ok() ? out.size() : 0;
+}
+
+uint32_t encode_packet(const Handshake_Packet& hs, uint8_t *buf,
+      uint32_t buf_len) {
+   WireWriter out(buf, buf_len);
+   write_header(out, hs.header);
+   out.u8(hs.midi_format);
+   out.u8(hs.version);
+   return out.ok() ? out.size() : 0;
+}
+
+uint32_t encode_packet(const Sync_Packet& sync, uint8_t *buf,
+      uint32_t buf_len) {
+   WireWriter out(buf, buf_len);
+   write_header(out, sync.header);
+   out.u32(sync.sync_seq);
+   out.i64(sync.t1);
+   out.i64(sync.t2);
+   out.i64(sync.t3);
+   out.i64(sync.t4);
+   out.i64(sync.clock_offset);
+   out.i64(sync.offset_time);
+   out.i64(sync.skew_ppb);
+   out.u8(sync.offset_valid);
+   return out.ok() ? out.size() : 0;
+}
+
+uint32_t encode_packet(const Timed_Midi_Header& timed, uint8_t *buf,
+      uint32_t buf_len) {
+   WireWriter out(buf, buf_len);
+   write_header(out, timed.header);
+   out.i64(timed.base_time);
+   return out.ok() ? out.size() : 0;
+}
+
+uint32_t encode_packet(const Parity_Header& parity, uint8_t *buf,
+      uint32_t buf_len) {
+   WireWriter out(buf, buf_len);
+   write_header(out, parity.header);
+   out.u8(parity.num_packets);
+   out.u16(parity.len_xor);
+   for (int i = 0; i < MAX_FEC_GROUP; ++i) {
+      out.u32(parity.seq_nums[i]);
+   }
+   return out.ok() ? out.size() : 0;
+}
+
+uint32_t encode_packet(const Sysex_Header& sysex, uint8_t *buf,
+      uint32_t buf_len) {
+   WireWriter out(buf, buf_len);
+   write_header(out, sysex.header);
+   out.u32(sysex.first_seq);
+   out.u32(sysex.total_len);
+   out.u32(sysex.offset);
+   out.i64(sysex.base_time);
+   out.u32(sysex.timestamp);
+   out.u8(sysex.timed);
+   return out.ok() ? out.size() : 0;
+}
+
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Packet_Header *header) {
+   WireReader in(buf, len);
+   read_header(in, header);
+   return in.ok() ? in.size() : 0;
+}
+
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Handshake_Packet *hs) {
+   WireReader in(buf, len);
+   read_header(in, &hs->header);
+   if (!in.ok()) {
+      return 0;
+   }
+
+   hs->midi_format = in.remaining() > 0 ? in.u8() : 0;
+   hs->version = in.remaining() > 0 ? in.u8() : 0;
+   return in.size();
+}
+
+uint32_t decode_packet(const uint8_t *buf, uint32_t len, Sync_Packet *sync) {
+   WireReader in(buf, len);
+   read_header(in, &sync->header);
+   sync->sync_seq = in.u32();
+   sync->t1 = in.i64();
+   sync->t2 = in.i64();
+   sync->t3 = in.i64();
+   sync->t4 = in.i64();
+   sync->clock_offset = in.i64();
+   sync->offset_time = in.i64();
+   sync->skew_ppb = in.i64();
+   sync->offset_valid = in.u8();
+   return in.ok() ? in.size() : 0;
+}
+
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Timed_Midi_Header *timed) {
+   WireReader in(buf, len);
+   read_header(in, &timed->header);
+   timed->base_time = in.i64();
+   return in.ok() ? in.size() : 0;
+}
+
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Parity_Header *parity) {
+   WireReader in(buf, len);
+   read_header(in, &parity->header);
+   parity->num_packets = in.u8();
+   parity->len_xor = in.u16();
+   for (int i = 0; i < MAX_FEC_GROUP; ++i) {
+      parity->seq_nums[i] = in.u32();
+   }
+   return in.ok() ? in.size() : 0;
+}
+
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Sysex_Header *sysex) {
+   WireReader in(buf, len);
+   read_header(in, &sysex->header);
+   sysex->first_seq = in.u32();
+   sysex->total_len = in.u32();
+   sysex->offset = in.u32();
+   sysex->base_time = in.i64();
+   sysex->timestamp = in.u32();
+   sysex->timed = in.u8();
+   return in.ok() ? in.size() : 0;
+}
@@ -0,0 +1,213 @@
+#ifndef __WIRE__HPP__
+#define __WIRE__HPP__
+
+#include <stdint.h>
+#include "network/network.hpp"
+
+#define PROTOCOL_VERSION 1    // Version of the wire protocol spoken here.
+
+// Every multi-byte field goes over the wire in little endian, whatever the
+// host's byte order, and is read a byte at a time so nothing depends on the
+// alignment of the buffer. A packet's fields follow each other with no
+// padding, so the size of its packed struct is its size on the wire.
+
+inline void store_le16(uint8_t *out, uint16_t value) {
+   out[0] = (uint8_t)value;
+   out[1] = (uint8_t)(value >> 8);
+}
+
+inline void store_le32(uint8_t *out, uint32_t value) {
+   out[0] = (uint8_t)value;
+   out[1] = (uint8_t)(value >> 8);
+   out[2] = (uint8_t)(value >> 16);
+   out[3] = (uint8_t)(value >> 24);
+}
+
+inline void store_le64(uint8_t *out, uint64_t value) {
+   store_le32(out, (uint32_t)value);
+   store_le32(out + 4, (uint32_t)(value >> 32));
+}
+
+inline uint16_t load_le16(const uint8_t *in) {
+   return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+inline uint32_t load_le32(const uint8_t *in) {
+   return (uint32_t)in[0] | ((uint32_t)in[1] << 8) |
+      ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+inline uint64_t load_le64(const uint8_t *in) {
+   return (uint64_t)load_le32(in) | ((uint64_t)load_le32(in + 4) << 32);
+}
+
+// Writes fields one after the other into a caller's buffer. Writes that
+// would run past the end of the buffer are dropped and mark the writer as
+// overflowed, so a whole packet can be written and checked once at the end.
+class WireWriter {
+   private:
+      uint8_t *buf;                 // Buffer being written.
+      uint32_t capacity;            // Bytes the buffer can hold.
+      uint32_t offset;              // Bytes written so far.
+      bool overflow;                // True once a write didn't fit.
+
+      // Returns where to write len bytes, or NULL if they don't fit.
+      uint8_t *reserve(uint32_t len) {
+         if (overflow || len > capacity - offset) {
+            overflow = true;
+            return NULL;
+         }
+         offset += len;
+         return buf + offset - len;
+      }
+
+   public:
+      WireWriter(uint8_t *buf, uint32_t capacity) : buf(buf),
+            capacity(capacity), offset(0), overflow(false) {}
+
+      // Returns true if every write so far fit.
+      bool ok() const {
+         return !overflow;
+      }
+
+      // Returns the number of bytes written.
+      uint32_t size() const {
+         return offset;
+      }
+
+      void u8(uint8_t value) {
+         uint8_t *out = reserve(1);
+         if (out != NULL) {
+            out[0] = value;
+         }
+      }
+
+      void u16(uint16_t value) {
+         uint8_t *out = reserve(2);
+         if (out != NULL) {
+            store_le16(out, value);
+         }
+      }
+
+      void u32(uint32_t value) {
+         uint8_t *out = reserve(4);
+         if (out != NULL) {
+            store_le32(out, value);
+         }
+      }
+
+      void u64(uint64_t value) {
+         uint8_t *out = reserve(8);
+         if (out != NULL) {
+            store_le64(out, value);
+         }
+      }
+
+      void i64(int64_t value) {
+         u64((uint64_t)value);
+      }
+};
+
+// Reads fields one after the other out of a received buffer without copying
+// it. Reads past the end of the buffer return 0 and mark the reader as
+// overflowed, so a whole packet can be read and checked once at the end.
+class WireReader {
+   private:
+      const uint8_t *buf;           // Buffer being read.
+      uint32_t len;                 // Bytes in the buffer.
+      uint32_t offset;              // Bytes read so far.
+      bool overflow;                // True once a read came up short.
+
+      // Returns where to read count bytes from, or NULL if there aren't that
+      // many left.
+      const uint8_t *take(uint32_t count) {
+         if (overflow || count > len - offset) {
+            overflow = true;
+            return NULL;
+         }
+         offset += count;
+         return buf + offset - count;
+      }
+
+   public:
+      WireReader(const uint8_t *buf, uint32_t len) : buf(buf), len(len),
+            offset(0), overflow(false) {}
+
+      // Returns true if every read so far was in bounds.
+      bool ok() const {
+         return !overflow;
+      }
+
+      // Returns the number of bytes read.
+      uint32_t size() const {
+         return offset;
+      }
+
+      // Returns the number of bytes left to read.
+      uint32_t remaining() const {
+         return len - offset;
+      }
+
+      // Returns a pointer to the next count bytes in the buffer itself and
+      // moves past them, or NULL if there aren't that many left.
+      const uint8_t *bytes(uint32_t count) {
+         return take(count);
+      }
+
+      uint8_t u8() {
+         const uint8_t *in = take(1);
+         return in != NULL ? in[0] : 0;
+      }
+
+      uint16_t u16() {
+         const uint8_t *in = take(2);
+         return in != NULL ? load_le16(in) : 0;
+      }
+
+      uint32_t u32() {
+         const uint8_t *in = take(4);
+         return in != NULL ? load_le32(in) : 0;
+      }
+
+      uint64_t u64() {
+         const uint8_t *in = take(8);
+         return in != NULL ? load_le64(in) : 0;
+      }
+
+      int64_t i64() {
+         return (int64_t)u64();
+      }
+};
+
+// Write the packet into buf, which holds buf_len bytes, and return the number
+// of bytes written, 0 if it doesn't fit. Anything that follows the packet
+// (ie. its midi events) is up to the caller.
+uint32_t encode_packet(const Packet_Header& header, uint8_t *buf,
+      uint32_t buf_len);
+uint32_t encode_packet(const Handshake_Packet& hs, uint8_t *buf,
+      uint32_t buf_len);
+uint32_t encode_packet(const Sync_Packet& sync, uint8_t *buf,
+      uint32_t buf_len);
+uint32_t encode_packet(const Timed_Midi_Header& timed, uint8_t *buf,
+      uint32_t buf_len);
+uint32_t encode_packet(const Parity_Header& parity, uint8_t *buf,
+      uint32_t buf_len);
+uint32_t encode_packet(const Sysex_Header& sysex, uint8_t *buf,
+      uint32_t buf_len);
+
+// Read the packet out of the len bytes at buf and return the number of bytes
+// read, 0 if there aren't enough. A handshake from a peer that predates its
+// trailing fields may leave them out, they read as 0.
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Packet_Header *header);
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Handshake_Packet *hs);
+uint32_t decode_packet(const uint8_t *buf, uint32_t len, Sync_Packet *sync);
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Timed_Midi_Header *timed);
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Parity_Header *parity);
+uint32_t decode_packet(const uint8_t *buf, uint32_t len,
+      Sysex_Header *sysex);
+
+#endif
@@ -0,0 +1,88 @@
+#include "network/network.hpp"
+#include "server/addr_table.hpp"
+
+// Mixes the address and port into a well spread 32 bit hash (Fibonacci
+// hashing), since client addresses often only differ in their low bits.
+static uint32_t hash_addr(uint32_t ip, uint16_t port) {
+   uint64_t key = ((uint64_t)ip << 16) | port;
+   return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+AddrTable::AddrTable() {
+   clear();
+}
+
+AddrTable::~AddrTable() {
+}
+
+void AddrTable::clear() {
+   AddrSlot empty;
+   memset(&empty, '\0', sizeof(AddrSlot));
+   slots.assign(ADDR_TABLE_MIN_SLOTS, empty);
+   count = 0;
+}
+
+bool AddrTable::find(const sockaddr_in& addr, int *value) {
+   ASSERT(value != NULL);
+
+   AddrSlot *slot = &slots[probe(addr.sin_addr.s_addr, addr.sin_port)];
+   if (!slot->used) {
+      return false;
+   }
+
+   *value = slot->value;
+   return true;
+}
+
+void AddrTable::grow() {
+   std::vector<AddrSlot> old_slots;
+   std::vector<AddrSlot>::iterator it;
+   AddrSlot *slot;
+
+   AddrSlot empty;
+   memset(&empty, '\0', sizeof(AddrSlot));
+   old_slots.swap(slots);
+   slots.assign(old_slots.size() * 2, empty);
+
+   for (it = old_slots.begin(); it != old_slots.end(); ++it) {
+      if (it->used) {
+         slot = &slots[probe(it->ip, it->port)];
+         *slot = *it;
+      }
+   }
+}
+
+void AddrTable::insert(const sockaddr_in& addr, int value) {
+   AddrSlot *slot;
+
+   // Keep the table at most 3/4 full so probe sequences stay short.
+   if ((count + 1) * 4 > slots.size() * 3) {
+      grow();
+   }
+
+   slot = &slots[probe(addr.sin_addr.s_addr, addr.sin_port)];
+   if (!slot->used) {
+      slot->ip = addr.sin_addr.s_addr;
+      slot->port = addr.sin_port;
+      slot->used = true;
+      ++count;
+   }
+   slot->value = value;
+}
+
+uint32_t AddrTable::probe(uint32_t ip, uint16_t port) {
+   uint32_t mask = slots.size() - 1;
+   uint32_t index = hash_addr(ip, port) & mask;
+
+   // The table is never full, so this always lands on a match or a hole.
+   while (slots[index].used &&
+         (slots[index].ip != ip || slots[index].port != port)) {
+      index = (index + 1) & mask;
+   }
+
+   return index;
+}
+
+uint32_t AddrTable::size() {
+   return count;
+}
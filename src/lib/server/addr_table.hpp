@@ -0,0 +1,53 @@
+#ifndef __ADDR_TABLE__HPP__
+#define __ADDR_TABLE__HPP__
+
+#include <stdint.h>
+#include <netinet/in.h>       // sockaddr_in
+#include <vector>
+
+#define ADDR_TABLE_MIN_SLOTS 16  // Slots in an empty table (power of two).
+
+// A slot in the AddrTable, keyed by a client's ip and port.
+typedef struct AddrSlot {
+   uint32_t ip;      // Client's ip address (network order).
+   uint16_t port;    // Client's port (network order).
+   bool used;        // True if the slot holds an entry.
+   int value;        // Value stored for the address (ie. a client id).
+} AddrSlot;
+
+// Flat open-addressed hash table mapping a client's socket address to an int.
+// Every entry lives in one contiguous array and collisions are resolved by
+// linear probing, so a lookup on the receive path usually touches a single
+// cache line.
+class AddrTable {
+   private:
+      std::vector<AddrSlot> slots;  // Power of two sized slot array.
+      uint32_t count;               // Number of used slots.
+
+      // Doubles the number of slots and reinserts every entry.
+      void grow();
+
+      // Returns the slot holding the address, or the empty slot it would go
+      // in if it isn't in the table.
+      uint32_t probe(uint32_t ip, uint16_t port);
+
+   public:
+      AddrTable();
+
+      ~AddrTable();
+
+      // Removes every entry from the table.
+      void clear();
+
+      // Sets value to the value stored for addr, returning false if the
+      // address isn't in the table.
+      bool find(const sockaddr_in& addr, int *value);
+
+      // Stores value for addr, replacing any value already stored for it.
+      void insert(const sockaddr_in& addr, int value);
+
+      // Returns the number of entries in the table.
+      uint32_t size();
+};
+
+#endif
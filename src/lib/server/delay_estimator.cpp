@@ -0,0 +1,166 @@
+#include <stdlib.h>           // strtol
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "network/network.hpp"
+#include "server/delay_estimator.hpp"
+
+MeanEstimator::MeanEstimator() {
+   sum = 0;
+}
+
+DelayEstimator *MeanEstimator::clone() const {
+   return new MeanEstimator(*this);
+}
+
+nsec_t MeanEstimator::estimate() const {
+   if (samples.empty()) {
+      return 0;
+   }
+   return sum / (nsec_t)samples.size();
+}
+
+std::string MeanEstimator::name() const {
+   return "mean";
+}
+
+void MeanEstimator::sample(nsec_t delay) {
+   samples.push_back(delay);
+   sum += delay;
+   if (samples.size() > MEAN_DELAY_WINDOW) {
+      sum -= samples.front();
+      samples.pop_front();
+   }
+}
+
+SrttEstimator::SrttEstimator(double var_factor) {
+   this->var_factor = var_factor;
+   primed = false;
+   srtt = 0;
+   rttvar = 0;
+}
+
+DelayEstimator *SrttEstimator::clone() const {
+   return new SrttEstimator(*this);
+}
+
+nsec_t SrttEstimator::estimate() const {
+   return (nsec_t)(srtt + var_factor * rttvar);
+}
+
+std::string SrttEstimator::name() const {
+   return var_factor == 0 ? "ewma" : "srtt";
+}
+
+void SrttEstimator::sample(nsec_t delay) {
+   // The first sample seeds the average, with half of it as the variation.
+   if (!primed) {
+      srtt = (double)delay;
+      rttvar = (double)delay / 2;
+      primed = true;
+      return;
+   }
+
+   // The variation is updated against the old average, as in RFC 6298.
+   rttvar = (1 - RTTVAR_GAIN) * rttvar + RTTVAR_GAIN *
+      std::fabs(srtt - (double)delay);
+   srtt = (1 - SRTT_GAIN) * srtt + SRTT_GAIN * (double)delay;
+}
+
+MinFilterEstimator::MinFilterEstimator() {
+   count = 0;
+}
+
+DelayEstimator *MinFilterEstimator::clone() const {
+   return new MinFilterEstimator(*this);
+}
+
+nsec_t MinFilterEstimator::estimate() const {
+   if (window.empty()) {
+      return 0;
+   }
+   return window.front().second;
+}
+
+std::string MinFilterEstimator::name() const {
+   return "min";
+}
+
+void MinFilterEstimator::sample(nsec_t delay) {
+   // Samples at least as large as the new one can never be the minimum
+   // again, so the window stays sorted and the minimum is always in front.
+   while (!window.empty() && window.back().second >= delay) {
+      window.pop_back();
+   }
+   window.push_back(std::make_pair(count, delay));
+   ++count;
+
+   if (window.front().first + MIN_FILTER_WINDOW < count) {
+      window.pop_front();
+   }
+}
+
+PercentileEstimator::PercentileEstimator(int percentile) {
+   this->percentile = percentile;
+}
+
+DelayEstimator *PercentileEstimator::clone() const {
+   return new PercentileEstimator(*this);
+}
+
+nsec_t PercentileEstimator::estimate() const {
+   std::vector<nsec_t> sorted;
+   uint32_t rank;
+
+   if (samples.empty()) {
+      return 0;
+   }
+
+   // Nearest rank percentile.
+   sorted.assign(samples.begin(), samples.end());
+   rank = (uint32_t)std::ceil(percentile / 100.0 * sorted.size());
+   rank = std::max(rank, (uint32_t)1) - 1;
+   std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+   return sorted[rank];
+}
+
+std::string PercentileEstimator::name() const {
+   return "p" + std::to_string(percentile);
+}
+
+void PercentileEstimator::sample(nsec_t delay) {
+   samples.push_back(delay);
+   if (samples.size() > PERCENTILE_WINDOW) {
+      samples.pop_front();
+   }
+}
+
+DelayEstimator *make_delay_estimator(const std::string& name) {
+   char *endptr;
+   long percentile;
+
+   if (name == "mean") {
+      return new MeanEstimator();
+   }
+   else if (name == "ewma") {
+      return new SrttEstimator(0);
+   }
+   else if (name == "srtt") {
+      return new SrttEstimator(SRTT_VAR_FACTOR);
+   }
+   else if (name == "min") {
+      return new MinFilterEstimator();
+   }
+   else if (name.size() > 1 && name[0] == 'p') {
+      percentile = strtol(name.c_str() + 1, &endptr, 10);
+      if (*endptr == '\0' && percentile >= 1 && percentile <= 100) {
+         return new PercentileEstimator((int)percentile);
+      }
+   }
+
+   return NULL;
+}
+
+const char *delay_estimator_names() {
+   return "mean, ewma, srtt, min, p1-p100";
+}
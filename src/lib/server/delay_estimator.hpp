@@ -0,0 +1,122 @@
+#ifndef __DELAY_ESTIMATOR__HPP__
+#define __DELAY_ESTIMATOR__HPP__
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include "network/clock.hpp"
+
+#define DEFAULT_DELAY_ESTIMATOR "mean" // Estimator clients get by default.
+
+#define MEAN_DELAY_WINDOW 9      // Delay samples the windowed mean averages.
+
+#define SRTT_GAIN 0.125          // Weight of a new sample in the smoothed delay.
+
+#define RTTVAR_GAIN 0.25         // Weight of a new sample in the smoothed
+                                 // delay variation.
+
+#define SRTT_VAR_FACTOR 4        // Multiples of the delay variation the srtt
+                                 // estimator pads the smoothed delay by.
+
+#define MIN_FILTER_WINDOW 32     // Delay samples the min-filter looks back on.
+
+#define PERCENTILE_WINDOW 64     // Delay samples the percentile is taken of.
+
+// Turns the one way delays measured by a client's sync exchanges into the
+// delay the server plans the client's playback around. Each client gets its
+// own estimator, picked by name when the server starts.
+class DelayEstimator {
+   public:
+      virtual ~DelayEstimator() {}
+
+      // Returns a copy of the estimator, state and all.
+      virtual DelayEstimator *clone() const = 0;
+
+      // Returns the current delay estimate (ns). Only meaningful once a
+      // sample has been added.
+      virtual nsec_t estimate() const = 0;
+
+      // Returns the name the estimator is selected by.
+      virtual std::string name() const = 0;
+
+      // Folds a one way delay (ns) measured by a sync exchange into the
+      // estimate.
+      virtual void sample(nsec_t delay) = 0;
+};
+
+// Mean of the last few samples, what the server has always used.
+class MeanEstimator : public DelayEstimator {
+   private:
+      std::deque<nsec_t> samples;   // The most recent samples.
+      nsec_t sum;                   // Sum of the samples.
+
+   public:
+      MeanEstimator();
+
+      DelayEstimator *clone() const;
+      nsec_t estimate() const;
+      std::string name() const;
+      void sample(nsec_t delay);
+};
+
+// TCP's smoothed round trip time (RFC 6298): an exponentially weighted
+// moving average of the delay, padded by var_factor times the smoothed
+// variation of the delay. With no padding this is a plain EWMA.
+class SrttEstimator : public DelayEstimator {
+   private:
+      double var_factor;            // Multiples of rttvar added to srtt.
+      bool primed;                  // True once the first sample is in.
+      double srtt;                  // Smoothed delay (ns).
+      double rttvar;                // Smoothed variation of the delay (ns).
+
+   public:
+      SrttEstimator(double var_factor);
+
+      DelayEstimator *clone() const;
+      nsec_t estimate() const;
+      std::string name() const;
+      void sample(nsec_t delay);
+};
+
+// Smallest of the recent samples. Queueing only ever adds delay, so the
+// minimum tracks the path's propagation delay.
+class MinFilterEstimator : public DelayEstimator {
+   private:
+      // Samples that could still become the minimum, increasing from the
+      // front, each with the number of the sample it was.
+      std::deque<std::pair<uint64_t, nsec_t> > window;
+      uint64_t count;               // Number of samples taken so far.
+
+   public:
+      MinFilterEstimator();
+
+      DelayEstimator *clone() const;
+      nsec_t estimate() const;
+      std::string name() const;
+      void sample(nsec_t delay);
+};
+
+// The given percentile of the recent samples, so only that share of events
+// should arrive after the delay planned for them.
+class PercentileEstimator : public DelayEstimator {
+   private:
+      int percentile;               // Percentile (1-100) to estimate.
+      std::deque<nsec_t> samples;   // The most recent samples.
+
+   public:
+      PercentileEstimator(int percentile);
+
+      DelayEstimator *clone() const;
+      nsec_t estimate() const;
+      std::string name() const;
+      void sample(nsec_t delay);
+};
+
+// Returns a new estimator by name: "mean", "ewma", "srtt", "min" or "pNN"
+// for the NNth percentile (ie. "p95"). Returns NULL for unknown names.
+DelayEstimator *make_delay_estimator(const std::string& name);
+
+// Returns the names make_delay_estimator() knows, for usage messages.
+const char *delay_estimator_names();
+
+#endif
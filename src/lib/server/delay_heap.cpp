@@ -0,0 +1,101 @@
+#include "network/network.hpp"
+#include "server/delay_heap.hpp"
+
+DelayHeap::DelayHeap() {
+}
+
+DelayHeap::~DelayHeap() {
+}
+
+bool DelayHeap::empty() {
+   return heap.empty();
+}
+
+void DelayHeap::remove(int client) {
+   std::unordered_map<int, uint32_t>::iterator it = index.find(client);
+   uint32_t i;
+
+   if (it == index.end()) {
+      return;
+   }
+
+   // Move the last entry into the client's slot and settle it from there.
+   i = it->second;
+   swap_entries(i, heap.size() - 1);
+   heap.pop_back();
+   index.erase(client);
+   if (i < heap.size()) {
+      sift_up(i);
+      sift_down(i);
+   }
+}
+
+void DelayHeap::sift_down(uint32_t i) {
+   uint32_t largest;
+   uint32_t child;
+
+   while (true) {
+      largest = i;
+      child = 2 * i + 1;
+      if (child < heap.size() && heap[child].delay > heap[largest].delay) {
+         largest = child;
+      }
+      ++child;
+      if (child < heap.size() && heap[child].delay > heap[largest].delay) {
+         largest = child;
+      }
+      if (largest == i) {
+         return;
+      }
+      swap_entries(i, largest);
+      i = largest;
+   }
+}
+
+void DelayHeap::sift_up(uint32_t i) {
+   uint32_t parent;
+
+   while (i > 0) {
+      parent = (i - 1) / 2;
+      if (heap[parent].delay >= heap[i].delay) {
+         return;
+      }
+      swap_entries(i, parent);
+      i = parent;
+   }
+}
+
+uint32_t DelayHeap::size() {
+   return heap.size();
+}
+
+void DelayHeap::swap_entries(uint32_t i, uint32_t j) {
+   ClientDelay entry = heap[i];
+   heap[i] = heap[j];
+   heap[j] = entry;
+   index[heap[i].client] = i;
+   index[heap[j].client] = j;
+}
+
+const ClientDelay& DelayHeap::top() {
+   ASSERT(!heap.empty());
+   return heap.front();
+}
+
+void DelayHeap::update(int client, nsec_t delay) {
+   std::unordered_map<int, uint32_t>::iterator it = index.find(client);
+   ClientDelay entry;
+
+   if (it == index.end()) {
+      entry.delay = delay;
+      entry.client = client;
+      heap.push_back(entry);
+      index[client] = heap.size() - 1;
+      sift_up(heap.size() - 1);
+      return;
+   }
+
+   heap[it->second].delay = delay;
+   sift_up(it->second);
+   sift_down(index[client]);
+}
@@ -0,0 +1,58 @@
+#ifndef __DELAY_HEAP__HPP__
+#define __DELAY_HEAP__HPP__
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+#include "network/clock.hpp"
+
+// A client's delay held by the DelayHeap.
+typedef struct ClientDelay {
+   nsec_t delay;     // The client's estimated delay.
+   int client;       // Id of the client.
+} ClientDelay;
+
+// Indexed max-heap of the delays of the active clients. Each client's slot
+// in the heap is tracked, so a client's delay can be changed (or the client
+// taken out) in O(log n) and the largest delay is always on top, instead of
+// rescanning every client whenever one of them changes.
+class DelayHeap {
+   private:
+      // Binary heap of the clients' delays, largest delay on top.
+      std::vector<ClientDelay> heap;
+
+      // Mapping of client id to the client's index in the heap.
+      std::unordered_map<int, uint32_t> index;
+
+      // Moves the entry at i down until neither child has a larger delay.
+      void sift_down(uint32_t i);
+
+      // Moves the entry at i up until its parent has a delay at least as
+      // large.
+      void sift_up(uint32_t i);
+
+      // Swaps the entries at i and j, keeping the index up to date.
+      void swap_entries(uint32_t i, uint32_t j);
+
+   public:
+      DelayHeap();
+
+      ~DelayHeap();
+
+      // Returns true if no clients are in the heap.
+      bool empty();
+
+      // Takes the client out of the heap, if it is in it.
+      void remove(int client);
+
+      // Returns the number of clients in the heap.
+      uint32_t size();
+
+      // Returns the client with the largest delay.
+      const ClientDelay& top();
+
+      // Sets the client's delay, adding the client if it isn't in the heap.
+      void update(int client, nsec_t delay);
+};
+
+#endif
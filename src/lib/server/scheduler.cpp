@@ -0,0 +1,47 @@
+#include <algorithm>
+#include "network/network.hpp"
+#include "server/scheduler.hpp"
+
+// Orders the heap so the earliest deadline ends up at the front.
+static bool later_deadline(const ScheduledTrack& a, const ScheduledTrack& b) {
+   return a.deadline > b.deadline;
+}
+
+TrackScheduler::TrackScheduler() {
+}
+
+TrackScheduler::~TrackScheduler() {
+}
+
+void TrackScheduler::clear() {
+   heap.clear();
+}
+
+bool TrackScheduler::empty() {
+   return heap.empty();
+}
+
+void TrackScheduler::pop() {
+   ASSERT(!heap.empty());
+   std::pop_heap(heap.begin(), heap.end(), later_deadline);
+   heap.pop_back();
+}
+
+void TrackScheduler::push(nsec_t deadline, int track, int client) {
+   ScheduledTrack scheduled;
+   scheduled.deadline = deadline;
+   scheduled.track = track;
+   scheduled.client = client;
+
+   heap.push_back(scheduled);
+   std::push_heap(heap.begin(), heap.end(), later_deadline);
+}
+
+uint32_t TrackScheduler::size() {
+   return heap.size();
+}
+
+const ScheduledTrack& TrackScheduler::top() {
+   ASSERT(!heap.empty());
+   return heap.front();
+}
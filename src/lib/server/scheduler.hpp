@@ -0,0 +1,48 @@
+#ifndef __SCHEDULER__HPP__
+#define __SCHEDULER__HPP__
+
+#include <stdint.h>
+#include <vector>
+#include "network/clock.hpp"
+
+// A track waiting in the scheduler along with the time its next event is due
+// to be sent out.
+typedef struct ScheduledTrack {
+   nsec_t deadline;  // clock_now() time when the track's next event is due.
+   int track;        // Track whose front event is due at the deadline.
+   int client;       // Id of the client that plays the track.
+} ScheduledTrack;
+
+// Min-heap of tracks ordered by the deadline of their next event, so the
+// server only touches tracks which are actually due instead of scanning every
+// track of every client each time it wakes up.
+class TrackScheduler {
+   private:
+      // Binary heap of the scheduled tracks, earliest deadline on top.
+      std::vector<ScheduledTrack> heap;
+
+   public:
+      TrackScheduler();
+
+      ~TrackScheduler();
+
+      // Removes all of the scheduled tracks.
+      void clear();
+
+      // Returns true if no tracks are scheduled.
+      bool empty();
+
+      // Removes the track with the earliest deadline.
+      void pop();
+
+      // Schedules the track to be serviced at the deadline.
+      void push(nsec_t deadline, int track, int client);
+
+      // Returns the number of scheduled tracks.
+      uint32_t size();
+
+      // Returns the track with the earliest deadline.
+      const ScheduledTrack& top();
+};
+
+#endif
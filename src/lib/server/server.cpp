@@ -1,4 +1,5 @@
 #include <arpa/inet.h>        // htons
+#include <errno.h>            // errno, EAGAIN
 #include <fcntl.h>            // O_CREAT, O_TRUNC, O_WRONLY
 #include <netinet/in.h>       // sockaddr_in
 #include <stdio.h>            // printf
@@ -12,9 +13,11 @@
 #include <string>
 #include <algorithm>
 #include "network/network.hpp"
+#include "network/wire.hpp"
 #include "server/server.hpp"
 
-Server::Server(int num_args, char **arg_list) {
+Server::Server(int num_args, char **arg_list) : recv_batch(MAX_RECV_BATCH),
+      song_cache(0) {
    // Ensure that command line arguments are good.
    if (!parse_inputs(num_args, arg_list)) {
       print_usage();
@@ -35,77 +38,54 @@ Server::Server(int num_args, char **arg_list) {
 }
 
 Server::~Server() {
-}
-
-void Server::append_to_buf(MyPmEvent *event) {
-   ASSERT(event != NULL);
-   ASSERT(midi_header->flag == flag::MIDI);
-   event->serialize(buf, buf_offset);
-   buf_offset += SIZEOF_MIDI_EVENT;
-   ++midi_header->num_midi_events;
-}
-
-void Server::calc_delay(ClientInfo& client){
-   if (client.delay_times.size() > NUM_DELAY_SAMPLES) {
-      client.delay_times.pop_front();
+   std::vector<Shard *>::iterator it;
+   for (it = shards.begin(); it != shards.end(); ++it) {
+      delete *it;
    }
 
-   std::deque<long>::iterator it;
-   for (it = client.delay_times.begin(); it != client.delay_times.end(); it++) {
-      client.avg_delay += *it;
+   delete song_loader;
+
+   if (rtt_trace != NULL) {
+      fclose(rtt_trace);
    }
-   client.avg_delay /= client.delay_times.size();
-   print_debug("client %d's delay: %lu\n", client.fd, client.avg_delay);
 }
 
-void Server::config_fd_set_for_normal_traffic() {
-   // Clear initial fd_set.
-   FD_ZERO(&normal_fds);
+void Server::assign_track(int track, ClientInfo& owner) {
+   ShardCommand command;
+   std::unordered_map<int, int>::iterator shard_it;
+   int target;
 
-   // Add client socket fd to the FD list to listen for
-   std::unordered_map<int, ClientInfo>::iterator it;
-   for (it = fd_to_client_info.begin(); it != fd_to_client_info.end(); ++it) {
-      FD_SET(it->second.fd, &normal_fds);
-   }
+   track_to_owner[track] = owner.id;
 
-   // Remove the priority client from the fd_set if a priority client exists
-   if (fd_to_client_info.size() > 0) {
-      FD_CLR(sync_client->fd, &normal_fds);
+   // Tracks that already finished playing don't need to go anywhere.
+   shard_it = track_to_shard.find(track);
+   if (shard_it == track_to_shard.end()) {
+      return;
    }
-}
-
-void Server::config_fd_set_for_priority_traffic() {
-   // Clear initial fd_set.
-   FD_ZERO(&priority_fds);
 
-   // Add the current priority client to the fd_set
-   if (fd_to_client_info.size() > 0) {
-      FD_SET(sync_client->fd, &priority_fds);
+   // The track is on its way back from another shard, it will be forwarded
+   // to the new owner once it arrives.
+   if (shard_it->second < 0) {
+      return;
    }
-}
-
-void Server::config_fd_set_for_stdin() {
-   // Clear initial fd_set.
-   FD_ZERO(&normal_fds);
-
-   FD_SET(STDIN, &normal_fds);
-}
-
-void Server::config_fd_set_for_server_socket() {
-   // Clear initial fd_set.
-   FD_ZERO(&normal_fds);
-
-   FD_SET(server_sock, &normal_fds);
-}
-
-int Server::connection_ready(fd_set fds) {
-   set_timeval(0);
 
-   // Just select on the world for now
-   int num_fds_available = select(max_sock + 1, &fds, NULL, NULL, &tv);
-   ASSERT(num_fds_available >= 0);
+   command.song = song_id;
+   command.track = track;
+   command.client = owner.id;
 
-   return num_fds_available;
+   target = owner.id % shards.size();
+   if (shard_it->second == target) {
+      // Same shard, so it just needs to know who plays the track now.
+      command.type = shard::TRACK_OWNER;
+      shards[target]->post_command(command);
+   }
+   else {
+      // Pull the track back from its current shard first, it is forwarded to
+      // the new one in handle_shard_replies.
+      command.type = shard::TRACK_REVOKE;
+      shards[shard_it->second]->post_command(command);
+      shard_it->second = -1;
+   }
 }
 
 void Server::handle_abort() {
@@ -113,92 +93,144 @@ void Server::handle_abort() {
    exit(1);
 }
 
-void Server::handle_client_packet(int fd) {
-   /*
-      ASSERT(fd >= 0);
-      int bytes_recv;
-      long current_time = 0;
-      long rtt;
-      uint32_t actual_seq_num;
+void Server::handle_client_datagram(ClientInfo& info, uint8_t *packet,
+      uint32_t len) {
+   Packet_Header header;
+   Sync_Packet sync;
 
-   // Get the current time
-   get_current_time(&current_time);
+   // The caller made sure there is a whole header.
+   decode_packet(packet, len, &header);
 
-   // Get a reference to this client's info
-   ClientInfo *info = &fd_to_client_info[fd];
+   // Update the client's info structure with the proper seq_num
+   info.seq_num = header.seq_num + 1;
 
-   // Extract the packet's seq_num
-   actual_seq_num = midi_header->seq_num;
-   print_debug("Client responded with seq_num %d\n", midi_header->seq_num);
-   print_debug("expected_seq_num %d\n", info->expected_seq_num);
+   // Update the client's expected_seq_num
+   info.expected_seq_num = info.seq_num + 1;
 
-   // If the actual sequence number in the received packet is greater than the
-   // expected_seq_num then we had packet loss (we will not concern
-   // ourselves with reordering for now).
-   if (actual_seq_num != info->expected_seq_num) {
-   // Drop all of the sequence number tracking for packets that came before
-   // the current packet we just received (because we assume those packets
-   // are lost).
-   while (info->expected_seq_num < actual_seq_num) {
-   info->packet_to_send_time.erase(info->expected_seq_num);
-   info->expected_seq_num += 2;
-   }
+   // Parse the packet
+   flag::Packet_Flag flag;
+   flag = (flag::Packet_Flag)header.flag;
+
+   // This packet has to either be a handshake_fin, sync_ack or midi_ack.
+   switch (flag) {
+      case flag::HS:
+         print_debug("Recv'd duplicate handshake!\n");
+         break;
+      case flag::HS_FIN:
+         print_debug("Recv'd handshake_fin!\n");
+         break;
+      case flag::SYNC_ACK:
+         print_debug("Recv'd sync_ack!\n");
+         // Only the ack for the client's sync in flight counts, anything
+         // else is a straggler from a sync that already timed out.
+         if (len != sizeof(Sync_Packet) ||
+               decode_packet(packet, len, &sync) == 0) {
+            print_debug("Dropping %d byte sync_ack\n", len);
+         }
+         else if (info.sync_outstanding && sync.sync_seq == info.sync_seq) {
+            handle_client_timing(info, sync);
+         }
+         else {
+            print_debug("Dropping stale sync_ack from client %d\n", info.fd);
+         }
+         break;
+      case flag::MIDI_ACK:
+         print_debug("Recv'd midi_ack!\n");
+         handle_client_packet(info, header.seq_num, false);
+         break;
+      case flag::FEC_ACK:
+         print_debug("Recv'd fec_ack!\n");
+         handle_client_packet(info, header.seq_num, true);
+         break;
+      default:
+         fprintf(stderr, "handle_client_msg fell through!\n");
+         handle_abort();
+         break;
    }
+}
 
-   print_debug("info->packet_to_send_time[%d]: %lu\n", actual_seq_num,
-   info->packet_to_send_time[actual_seq_num]);
-   print_debug("current_time: %lu\n", current_time);
-
-   // Determine the rtt for the packet.
-   rtt = current_time - info->packet_to_send_time[actual_seq_num];
+void Server::handle_client_msg(int fd) {
+   uint32_t num_packets;
+   Batch_Packet *packet;
+   ClientInfo *info;
 
-   // Remove this packet timing entry from the map of packets to dispatch time
-   info->packet_to_send_time.erase(actual_seq_num);
+   print_debug("Server::handle_client_msg!\n");
+   info = &(id_to_client_info[fd_to_client_id[fd]]);
+
+   // The client sockets are edge triggered, so keep reading until the socket
+   // runs dry or we will not hear about the leftover packets again. Each
+   // read picks up every ack that piled up, not just the first one.
+   do {
+      num_packets = recv_batch.receive(info->fd);
+      for (uint32_t i = 0; i < num_packets; ++i) {
+         packet = recv_batch.packet(i);
+         if (packet->len < sizeof(Packet_Header)) {
+            print_debug("Dropping %d byte packet from client %d\n",
+                  packet->len, info->fd);
+            continue;
+         }
 
-   // Update the client's delay
-   // FIXME: Need to make this better, right now this is just a placeholder!
-   // Ideally we will try multiple versions of delay computing so we can see
-   // which works best.
-   info->avg_delay = rtt / 2;
+         info->addr = packet->remote;
+         handle_client_datagram(*info, packet->buf, packet->len);
+      }
+   } while (recv_batch.full());
 
-   // TODO: Remove!!!!
    print_state();
-   //
-   */
+}
+
+void Server::handle_client_packet(ClientInfo& info, uint32_t seq_num,
+      bool recovered) {
+   ShardCommand command;
+
+   // The shard that sent the midi message keeps track of what was acked.
+   command.type = shard::PACKET_ACK;
+   command.song = song_id;
+   command.client = info.id;
+   command.seq_num = seq_num;
+   command.recovered = recovered;
+   shard_for(info)->post_command(command);
 }
 
 // This function handles setting up the client's timing.
-void Server::handle_client_timing(ClientInfo& info) {
+void Server::handle_client_timing(ClientInfo& info, Sync_Packet& sync) {
    print_debug("Server::handle_client_timing()!\n");
-   long rtt;
+   SyncSample sample;
+   nsec_t rtt;
 
    // Get the current time from the server's clock
-   get_current_time(&current_time);
-
-   // Get the difference between the current time and the previous time to
-   // determine the rtt.
-   rtt = current_time - info.last_msg_send_time;
-
-   // Divide the rtt to get the one sided delay (assuming the delays are equal
-   // on the way to the client and the way back).
-   //info.delay_times.push_back(rtt / 2);
-   info.session_delay += rtt / 2;
+   current_time = clock_now();
+   sync.t4 = current_time;
+   info.sync_outstanding = false;
+
+   // The round trip, less the time the client held on to the sync, is the
+   // time spent on the wire. The client's clock offset falls out of the
+   // timestamps too (assuming the delays are equal on the way to the client
+   // and the way back).
+   rtt = std::max((sync.t4 - sync.t1) - (sync.t3 - sync.t2), (nsec_t)0);
+   sample.time = sync.t1 + (sync.t4 - sync.t1) / 2;
+   sample.delay = rtt;
+   sample.offset = ((sync.t2 - sync.t1) + (sync.t3 - sync.t4)) / 2;
+   update_clock_offset(info, sample);
+
+   // Divide the rtt to get the one sided delay and let the client's
+   // estimator make of it what it will.
+   info.delay_estimator->sample(rtt / 2);
+   info.avg_delay = info.delay_estimator->estimate();
+   print_debug("client %d's delay: %ld\n", info.fd, info.avg_delay);
    ++info.session_delay_counter;
-   ++info.sync_counter;
+
+   // Record the round trip for replaying through other estimators later.
+   if (rtt_trace != NULL) {
+      fprintf(rtt_trace, "%d %ld %ld\n", info.id, (long)current_time,
+            (long)rtt);
+   }
 
    // If we have recv'd enough client sync messages to establish an avg. delay
    // for this client.
    if (info.session_delay_counter >= NUM_SYNC_TRIALS) {
       print_debug("Done syncing with client %d\n", info.fd);
 
-      // Condense the temporary rtt average for this sync set to 1 avg value.
-      info.delay_times.push_back(info.session_delay / info.sync_counter);
-      info.session_delay = 0;
       info.session_delay_counter = 0;
-      info.sync_counter = 0;
-
-      // Compute the average delay for this client
-      calc_delay(info);
 
       // If the client comes back alive, remove its tracks from other
       // clients that took over when it failed
@@ -206,16 +238,19 @@ void Server::handle_client_timing(ClientInfo& info) {
          // for every track in client_to_track
          std::vector<int>::iterator it;
          std::vector<int> * tracks;
-         tracks = &(client_to_track[info.fd]);
+         tracks = &(client_to_track[info.id]);
          std::unordered_map<int, ClientInfo>::iterator client_it;
 
          // The erase-remove idiom for the win
          for (it = tracks->begin(); it != tracks->end(); ++it) {
+            // Hand the track back to the returning client
+            assign_track(*it, info);
+
             // Search all other clients, remove from list
-            for (client_it = fd_to_client_info.begin();
-                  client_it != fd_to_client_info.end(); ++client_it) {
+            for (client_it = id_to_client_info.begin();
+                  client_it != id_to_client_info.end(); ++client_it) {
                // Ensure we don't remove the tracks from the returning client
-               if (client_it->second.fd != info.fd) {
+               if (client_it->second.id != info.id) {
                   client_it->second.tracks.erase(std::remove(
                            client_it->second.tracks.begin(), client_it->second.tracks.end(),
                            *it), client_it->second.tracks.end());
@@ -224,8 +259,8 @@ void Server::handle_client_timing(ClientInfo& info) {
          }
 
          // TODO: REMOVE
-         for (client_it = fd_to_client_info.begin();
-               client_it != fd_to_client_info.end(); ++client_it) {
+         for (client_it = id_to_client_info.begin();
+               client_it != id_to_client_info.end(); ++client_it) {
             for (it = client_it->second.tracks.begin();
                   it != client_it->second.tracks.end(); ++it) {
               //  fprintf(stderr, "client %d: track: %d\n", client_it->second.fd,
@@ -239,19 +274,16 @@ void Server::handle_client_timing(ClientInfo& info) {
          info.active = true;
       }
 
-      // Increment sync_it and check delays of all clients as needed
-      sync_next();
-
-      // Get the next client to sync with from the sync_it. Note that we are
-      // doing this because of some problematic issues surrounding a client
-      // joining while the sync_it is running through the previous clients.
-      print_debug("updated sync_client to %d\n", sync_client->fd);
-      send_sync_packet(*sync_client);
+      // Sync with the client again after a breather.
+      info.next_sync_time = current_time + msec_to_nsec(SYNC_PERIOD_MS);
    }
    // If we still need to do more sync trials to compute an avg. delay.
    else {
       send_sync_packet(info);
    }
+
+   // Let the shards know if the client's (or everyone's) send offset moved.
+   update_max_client_delay(info);
 }
 
 void Server::handle_done() {
@@ -264,253 +296,269 @@ void Server::handle_handshake() {
    exit(1);
 }
 
-void Server::handle_new_client() {
+void Server::handle_loaded_songs() {
+   LoadResult result;
+
+   while (song_loader->pop_result(result)) {
+      if (result.type == loader::DIRECTORY) {
+         if (result.num_songs < 0) {
+            fprintf(stderr, "Unable to open directory %s to prewarm!\n",
+                  result.path.c_str());
+         }
+         else {
+            printf("Prewarmed %d songs from %s (%u cached, %lu KB)\n",
+                  result.num_songs, result.path.c_str(), song_cache.size(),
+                  (unsigned long)(song_cache.used_bytes() / 1024));
+         }
+         continue;
+      }
+
+      // Hang onto every good song in case it is played (again).
+      if (result.song != NULL) {
+         song_cache.insert(result.key, result.song);
+      }
+
+      // Only the song the user asked for last gets played.
+      if (result.id != pending_load) {
+         continue;
+      }
+      pending_load = 0;
+
+      if (result.song == NULL) {
+         fprintf(stderr, "Error reading midifile %s!\n", result.path.c_str());
+         fprintf(stderr, "Midi song no good!\n");
+         continue;
+      }
+
+      song = result.song;
+      start_song();
+   }
+}
+
+void Server::handle_new_client(Batch_Packet *packet) {
    print_debug("Server::handle_new_client!\n");
 
    int result;
+   uint32_t len;
    ClientInfo info;
-   print_debug("Made empty client!\n");
-
-   // Recv message from client
-   result = recv_buf(server_sock, &info.addr, buf, sizeof(Handshake_Packet));
-   ASSERT(result == sizeof(Handshake_Packet));
+   Handshake_Packet hs;
+
+   // Clients that predate the midi format or the protocol version leave
+   // them off the end of the handshake.
+   if (packet->len > sizeof(Handshake_Packet) ||
+         decode_packet(packet->buf, packet->len, &hs) == 0) {
+      print_debug("Dropping %d byte handshake\n", packet->len);
+      return;
+   }
 
-   // Parse the handshake packet
-   flag::Packet_Flag flag;
-   flag = (flag::Packet_Flag)hs->header.flag;
+   // Anything else from an address we don't know (a stray packet, or acks
+   // from a client of a server that has since restarted) can reach here
+   // when every client shares the server's socket, so drop it.
+   if (hs.header.flag != flag::HS) {
+      print_debug("Dropping flag %d packet from an unknown client\n",
+            hs.header.flag);
+      return;
+   }
+   print_debug("Made empty client!\n");
+   info.id = next_client_id;
+   info.addr = packet->remote;
 
-   // Make sure the packet flag is a handshake
-   ASSERT(flag == flag::HS);
+   // Send the newest midi format both sides know.
+   info.midi_format = std::min(hs.midi_format, midi_format);
 
-   // Create a new socket to service this new client
-   info.fd = socket(AF_INET, SOCK_DGRAM, 0);
+   // The handshake is good, so the id is taken.
+   ++next_client_id;
 
-   // Update max_sock
-   if (info.fd > max_sock) {
-      max_sock = info.fd;
+   // Create a new socket to service this new client, unless every client
+   // shares the server's socket.
+   if (shared_socket) {
+      info.fd = server_sock;
+   }
+   else {
+      info.fd = socket(AF_INET, SOCK_DGRAM, 0);
+      ASSERT(info.fd >= 0);
+      set_nonblocking(info.fd);
    }
 
    // Update the client's sequence number
-   info.seq_num = ++(hs->header.seq_num);
+   info.seq_num = hs.header.seq_num + 1;
 
    // Update the client's expected_seq_num
    info.expected_seq_num = info.seq_num + 1;
 
    // Set the new client info's timing info to zero.
-   get_current_time(&current_time);
+   current_time = clock_now();
    info.last_msg_send_time = current_time;
-   info.avg_delay = 1000;
-   info.session_delay = 0;
+   info.avg_delay = msec_to_nsec(1000);
+   info.delay_estimator = make_delay_estimator(estimator_name);
    info.session_delay_counter = 0;
-   info.sync_counter = 0;
+   info.clock_offset = 0;
+   info.offset_time = 0;
+   info.offset_valid = false;
+   info.clock_skew = 0;
+   info.sync_seq = 0;
+   info.sync_outstanding = false;
+   info.next_sync_time = current_time;
 
    // Mark the client as active
    info.active = true;
 
-   // Build response packet to client
-   memset(buf, '\0', MAX_BUF_SIZE);
-   Packet_Header *ph = (Packet_Header *)buf;
-   ph->seq_num = info.seq_num;
-   ph->flag = flag::HS_GOOD;
+   // Build response packet to client, which speaks the older of the two
+   // protocol versions.
+   hs.header.seq_num = info.seq_num;
+   hs.header.flag = flag::HS_GOOD;
+   hs.header.num_midi_events = 0;
+   hs.midi_format = info.midi_format;
+   hs.version = std::min(hs.version, (uint8_t)PROTOCOL_VERSION);
+   len = encode_packet(hs, buf, MAX_BUF_SIZE);
 
    // Send hs ack to client
-   result = send_buf(info.fd, &info.addr, buf, sizeof(Packet_Header));
-   ASSERT(result == sizeof(Packet_Header));
-
-   // Add the clinet to the fd_to_client_info mapping
-   print_debug("assigning client %d to fd_to_client_info\n", info.fd);
-   fd_to_client_info[info.fd] = info;
-   print_debug("assigned client %d to fd_to_client_info\n", info.fd);
+   result = send_buf(info.fd, &info.addr, buf, len);
+   ASSERT(result == (int)len);
+
+   // Add the clinet to the id_to_client_info mapping
+   print_debug("assigning client %d to id_to_client_info\n", info.id);
+   id_to_client_info[info.id] = info;
+   print_debug("assigned client %d to id_to_client_info\n", info.id);
+
+   // Remember where the client talks from so its packets find their way back
+   // to it.
+   addr_to_client_id.insert(info.addr, info.id);
+   if (!shared_socket) {
+      fd_to_client_id[info.fd] = info.id;
+
+      // Have the reactor wake us up whenever this client says something
+      ASSERT(reactor.add_fd(info.fd, true));
+   }
 
-   // So we need to reset the iterator now that the underlying container
-   // changed and I realize that by shoving it back to the front it could
-   // "starve" some of the clients if we were flooded with connections, but
-   // we won't be and this should be fine.
-   sync_it = fd_to_client_info.begin();
+   // Let the client's shard know it exists.
+   id_to_client_info[info.id].published_active = false;
+   id_to_client_info[info.id].published_offset = -1;
+   id_to_client_info[info.id].published_play_delay = -1;
+   publish_client(id_to_client_info[info.id]);
 
-   // If this is the first client then setup the sync_client to get the sync
-   // train rolling.
-   if (fd_to_client_info.size() == 1) {
-      sync_client = &(sync_it->second);
-      send_sync_packet(*sync_client);
-   }
+   // Start measuring the new client's delay right away, alongside whoever
+   // else is being synced.
+   send_sync_packet(id_to_client_info[info.id]);
 
    print_state();
 }
 
-void Server::handle_normal_msg() {
-   print_debug("Server::handle_normal_msg!\n");
-   ClientInfo *info;
-  //  for (int i = STDERR + 1; i <= max_sock + 1; ++i) {
-  //     if (FD_ISSET(i, &normal_fds)) {
-  //        // Pull out the client's info
-  //        info = &(fd_to_client_info[i]);
-   //
-  //        // Receive the message into the buffer
-  //        int bytes_recv = recv_buf(i, &info->addr, buf, MAX_BUF_SIZE);
-  //        ASSERT(bytes_recv > 0);
-   //
-  //        // Handle its contents
-  //        handle_client_packet(i);
-  //     }
-  //  }
-}
-
 void Server::handle_parse_song() {
-   bool song_good;
+   std::string key;
+
+   // Whatever was playing before (or was about to) is done.
+   stop_song();
+   pending_load = 0;
+   state = server::WAIT_FOR_INPUT;
 
-   // Open the file to play
-   file_fd = open_target_file(filename);
-   if (file_fd < 0) {
+   // Make sure the file is there before doing anything else.
+   if (!SongCache::make_key(filename, &key)) {
       fprintf(stderr, "Midi song no good!\n");
-      state = server::WAIT_FOR_INPUT;
+      return;
    }
-   // If the file was opened successfully.
-   else {
-      // Parse the midi file
-      song_good = parse_midi_input();
-
-      // If the song is good, move to the play_song state
-      if (song_good) {
-         state = server::PLAY_SONG;
-
-         // Set the flag so we know a song is playing in the WAIT_FOR_INPUT
-         // state.
-         song_is_playing = true;
 
-         // Start the timer with 1 millisecond resolution and creates a thread to call
-         // the process_midi function every 1 millisecond.
-         time_error = Pt_Start(1, &process_midi, (void *)this);
-         //  fprintf(stderr, "value time_error: %d\n", time_error);
-      }
-      else {
-         fprintf(stderr, "Midi song no good!\n");
-         state = server::WAIT_FOR_INPUT;
-      }
+   // Songs that were played (or prewarmed) before start right away.
+   song = song_cache.find(key);
+   if (song != NULL) {
+      print_debug("Song %s is cached!\n", filename.c_str());
+      start_song();
+      return;
    }
+
+   // Otherwise the loader compiles the song in the background while we keep
+   // servicing the clients, the song starts once it shows up.
+   pending_load = ++next_load_id;
+   song_loader->load(loader::SONG, pending_load, filename);
+   printf("Loading %s\n", filename.c_str());
 }
 
 void Server::handle_play_song() {
-   MyPmEvent event;
-   MyPmMessage message;
-
-   ClientInfo *client;
-   std::deque<MyPmEvent> *track_deque;
-
-   song_is_playing = false;
-
-   std::unordered_map<int, ClientInfo>::iterator client_it;
-   std::vector<int>::iterator track_it;
-
-   // Loop through all of the clients
-   for (client_it = fd_to_client_info.begin(); client_it != fd_to_client_info.end();
-         ++client_it) {
-
-      // Only send tracks to active clients
-      print_debug("handle_play_song::client %d active %d\n",
-         client_it->second.fd, client_it->second.active);
-      if (client_it->second.active == true) {
-
-         // Loop through all of the tracks that this client is assigned
-         for (track_it = client_it->second.tracks.begin();
-               track_it != client_it->second.tracks.end(); ++track_it) {
-
-            // Get the deque that corresponds to the track
-            track_deque = &(track_queues[*track_it]);
-
-            if (track_deque->size()) {
-               song_is_playing = true;
-
-               // Get the next event
-               event = track_deque->front();
-
-               // Setup the buffer to send a midi message if its time to send.
-               //std::cout << "\tMidi Timer: " << midi_timer << std::endl;
-               // fprintf(stderr, "value midi_timer: %d\n", midi_timer);
-               if (event.timestamp <= midi_timer) {
-
-                  // Get the current client
-                  client = &(client_it->second);
-                  setup_midi_msg(client);
-
-                  // If any of the queues have events that need to be sent
-                  while (track_deque->size() && (event.timestamp +
-                           (max_client_delay - client_it->second.avg_delay)) <= midi_timer) {
-                     // Pull the midi message out of the PmEvent
-                     memcpy(message, event.message, 3 * sizeof(uint8_t));
-
-                     // Add this event to the buffered midi message
-                     append_to_buf(&event);
-
-                     // TODO -- this is for testing the notes locally
-                     //play_music_locally(buf, (buf_offset - SIZEOF_MIDI_EVENT));
-                     //
-
-                     // Remove the first event from the queue
-                     track_deque->pop_front();
-
-                     // Get a reference to the new front event of the queue.
-                     event = track_deque->front();
-                  }
-
-                  // Send the midi message to the client
-                  send_midi_msg(client);
-               }
-            }
-         }
-      }
+   // With no shard threads the control thread does the sending itself.
+   if (num_shards == 0) {
+      shards[0]->service(clock_now());
+      handle_shard_replies();
    }
 
-   // Go back to waiting for input from the clients, and expect that the
-   // process_midi function will be called by the PortMidi thread every 1
-   // millisecond to do the sending of the packets to the clients.
+   // The song is over once every track has been sent out.
+   song_is_playing = tracks_playing > 0;
+
+   // Go back to waiting for input from the clients, the reactor wakes us up
+   // again when the next events are due.
    state = server::WAIT_FOR_INPUT;
 }
 
-void Server::handle_priority_msg() {
-   int result;
+void Server::handle_server_msg() {
+   uint32_t num_packets;
+   Batch_Packet *packet;
+   int client_id;
    ClientInfo *info;
 
-   print_debug("Server::handle_priority_msg!\n");
-   for (int i = STDERR + 1; i <= max_sock + 1; ++i) {
-      if (FD_ISSET(i, &priority_fds)) {
-         info = &(fd_to_client_info[i]);
+   // The server socket is edge triggered too, so take everything that is
+   // waiting in as few reads as possible. Packets from known addresses come
+   // from clients sharing the server socket, the rest are new handshakes.
+   do {
+      num_packets = recv_batch.receive(server_sock);
+      for (uint32_t i = 0; i < num_packets; ++i) {
+         packet = recv_batch.packet(i);
+         if (!addr_to_client_id.find(packet->remote, &client_id)) {
+            handle_new_client(packet);
+            continue;
+         }
 
-         result = recv_buf(info->fd, &info->addr, buf, sizeof(Packet_Header));
-         ASSERT(result == sizeof(Packet_Header));
+         if (packet->len < sizeof(Packet_Header)) {
+            print_debug("Dropping %d byte packet from client %d\n",
+                  packet->len, client_id);
+            continue;
+         }
 
-         // Update the client's info structure with the proper seq_num
-         info->seq_num = ++midi_header->seq_num;
+         info = &(id_to_client_info[client_id]);
+         handle_client_datagram(*info, packet->buf, packet->len);
+      }
+   } while (recv_batch.full());
 
-         // Update the client's expected_seq_num
-         info->expected_seq_num = info->seq_num + 1;
+   print_state();
+}
 
-         // Parse the packet
-         flag::Packet_Flag flag;
-         flag = (flag::Packet_Flag)midi_header->flag;
+void Server::handle_shard_replies() {
+   ShardReply reply;
+   ShardCommand command;
+   ClientInfo *owner;
+   std::vector<Shard *>::iterator it;
+
+   for (it = shards.begin(); it != shards.end(); ++it) {
+      while ((*it)->pop_reply(reply)) {
+         // Replies about a song that was since stopped are stale.
+         if (reply.song != song_id) {
+            continue;
+         }
 
-         // This packet has to either be a handshake_fin packet or a sync_ack packet.
-         switch (flag) {
-            case flag::HS_FIN:
-               print_debug("Recv'd handshake_fin!\n");
+         switch (reply.type) {
+            case shard::TRACK_DONE:
+               track_to_shard.erase(reply.track);
+               --tracks_playing;
                break;
-            case flag::SYNC_ACK:
-               print_debug("Recv'd sync_ack!\n");
-               handle_client_timing(*info);
-               break;
-            case flag::MIDI_ACK:
-               print_debug("Recv'd midi_ack!\n");
-               handle_client_packet(i);
+
+            case shard::TRACK_RETURN:
+               // Forward the track on to the shard of its new owner.
+               owner = &(id_to_client_info[track_to_owner[reply.track]]);
+               command.type = shard::TRACK_ADD;
+               command.song = song_id;
+               command.track = reply.track;
+               command.client = owner->id;
+               command.events = reply.events;
+               command.cursor = reply.cursor;
+               shard_for(*owner)->post_command(command);
+               track_to_shard[reply.track] = owner->id % shards.size();
                break;
+
             default:
-               fprintf(stderr, "handle_priority_message fell through!\n");
+               fprintf(stderr, "Server::handle_shard_replies fell through!\n");
                handle_abort();
                break;
          }
       }
    }
-
-   print_state();
 }
 
 void Server::handle_song_fin() {
@@ -519,20 +567,22 @@ void Server::handle_song_fin() {
 }
 
 void Server::handle_sync_timeout(ClientInfo *info) {
+   // The sync is given up on, a late ack for it is dropped.
+   info->sync_outstanding = false;
+
    // Increment the number of times we've tried to sync with this client
    ++info->session_delay_counter;
 
    // Check to see if this client has timed out fully
    if (info->session_delay_counter >= NUM_SYNC_TRIALS) {
       // Zero the client's sync bookkeeping
-      info->session_delay = 0;
       info->session_delay_counter = 0;
-      info->sync_counter = 0;
 
       if (info->active) {
         //  fprintf(stderr, "SETTING CLIENT %d to INACTIVE!\n", info->fd);
          // Mark the client as inactive
          info->active = false;
+         publish_client(*info);
 
          ClientInfo *min_client = NULL;
          int min_client_tracks;
@@ -547,8 +597,8 @@ void Server::handle_sync_timeout(ClientInfo *info) {
             min_client_tracks = 1000;
 
             // Find the client with the least number of tracks
-            for (client_it = fd_to_client_info.begin();
-                  client_it != fd_to_client_info.end(); ++client_it) {
+            for (client_it = id_to_client_info.begin();
+                  client_it != id_to_client_info.end(); ++client_it) {
                // Only look at clients that are active
                if (client_it->second.active == true &&
                      client_it->second.tracks.size() < min_client_tracks) {
@@ -564,27 +614,79 @@ void Server::handle_sync_timeout(ClientInfo *info) {
               print_debug("assigning track %d to client %d\n", *track_it, min_client->fd);
               print_debug("client %d tracks.size(): %d\n", info->fd, info->tracks.size());
               min_client->tracks.push_back(*track_it);
+              assign_track(*track_it, *min_client);
             }
          }
          print_debug("DONESKIS!\n");
       }
 
-      // Increment sync_it and check delays of all clients as needed
-      sync_next();
+      // The client may have been holding up max_client_delay.
+      update_max_client_delay(*info);
+
+      // Try the client again after a breather.
+      info->next_sync_time = clock_now() + msec_to_nsec(SYNC_PERIOD_MS);
+      return;
    }
    // Send a new sync packet
-   send_sync_packet(*sync_client);
+   send_sync_packet(*info);
+}
+
+void Server::handle_syncs() {
+   std::unordered_map<int, ClientInfo>::iterator client_it;
+
+   // Every client has its own sync in flight, give up on the ones that took
+   // too long and start new ones for clients that are due.
+   current_time = clock_now();
+   for (client_it = id_to_client_info.begin();
+         client_it != id_to_client_info.end(); ++client_it) {
+      ClientInfo& info = client_it->second;
+      if (info.sync_outstanding && sync_deadline(info) < current_time) {
+         handle_sync_timeout(&info);
+      }
+      else if (!info.sync_outstanding && info.next_sync_time <= current_time) {
+         send_sync_packet(info);
+      }
+   }
 }
 
 void Server::handle_stdin() {
    std::string user_input;
-   getline(std::cin, user_input);
+   if (!getline(std::cin, user_input)) {
+      // stdin hit EOF, so stop watching it or the reactor will keep waking
+      // us up to read nothing.
+      print_debug("stdin closed!\n");
+      reactor.remove_fd(STDIN);
+      stdin_open = false;
+      return;
+   }
 
    std::istringstream iss(user_input);
 
    std::string token;
    iss >> token;
 
+   // Compile every song in a directory ahead of time.
+   if (token == "prewarm") {
+      std::string dir;
+      iss >> dir;
+      prewarm_songs(dir);
+      return;
+   }
+
+   // Have the shards print how many midi messages got through.
+   if (token == "stats") {
+      ShardCommand command;
+      command.type = shard::PRINT_STATS;
+      command.song = song_id;
+      for (int i = 0; i < (int)shards.size(); ++i) {
+         shards[i]->post_command(command);
+      }
+      if (num_shards == 0) {
+         shards[0]->drain_commands();
+      }
+      return;
+   }
+
    // For now, just assign the token to the filename
    filename.assign(token);
    std::cout << "filename: " << token << std::endl;
@@ -593,95 +695,126 @@ void Server::handle_stdin() {
 }
 
 void Server::handle_wait_for_input() {
-   int num_connections_available;
-
-   // Select on stdin to see if the user wants to do something
-   config_fd_set_for_stdin();
-   num_connections_available = connection_ready(normal_fds);
-   ASSERT(num_connections_available >= 0);
-   if (num_connections_available) {
-      print_debug("stdin!\n");
-      handle_stdin();
-   }
-
-   // Select on the server socket to see if any other clients are trying to chat
-   // with us:
-   config_fd_set_for_server_socket();
-   num_connections_available = connection_ready(normal_fds);
-   ASSERT(num_connections_available >= 0);
-   if (num_connections_available) {
-      // fprintf(stderr, "new client!\n");
-      handle_new_client();
-   }
-
-   // Select on the priority client sockets to see if they are saying anything
-   config_fd_set_for_priority_traffic();
-   num_connections_available = connection_ready(priority_fds);
-   ASSERT(num_connections_available >= 0);
-   if (num_connections_available) {
-      handle_priority_msg();
-   }
-   else {
-      // Check the timeout on the current syncing client and act apprioriately
-      get_current_time(&current_time);
-      if (sync_client != NULL && sync_client->last_msg_send_time +
-            MAX_SYNC_TIMEOUT * sync_client->avg_delay < current_time) {
+   int num_fds_ready;
+   int fd;
+   nsec_t deadline;
+
+   // Sleep until someone says something or the next deadline comes due.
+   num_fds_ready = reactor.wait(next_wakeup_timeout());
 
-        //  fprintf(stderr, "current_time: %lu\n", current_time);
-        //  fprintf(stderr, "sync_client %d last_msg_send_time: %lu\n", sync_client->fd, sync_client->last_msg_send_time);
-        //  fprintf(stderr, "sync_client %d avg_delay: %lu\n", sync_client->fd, sync_client->avg_delay);
-        //  fprintf(stderr, "sync_cilent %d active: %d\n", sync_client->fd, sync_client->active);
-         handle_sync_timeout(sync_client);
+   for (int i = 0; i < num_fds_ready; ++i) {
+      fd = reactor.ready_fd(i);
+
+      // The user wants to do something
+      if (fd == STDIN) {
+         print_debug("stdin!\n");
+         handle_stdin();
+      }
+      // Other clients are trying to chat with us
+      else if (fd == server_sock) {
+         handle_server_msg();
+      }
+      // A shard thread has something to tell us
+      else if (num_shards > 0 && fd == shard_pipe[0]) {
+         uint8_t pokes[MAX_BUF_SIZE];
+         while (read(shard_pipe[0], pokes, MAX_BUF_SIZE) > 0) {}
+         handle_shard_replies();
+      }
+      // The song loader finished loading something
+      else if (fd == loader_pipe[0]) {
+         uint8_t pokes[MAX_BUF_SIZE];
+         while (read(loader_pipe[0], pokes, MAX_BUF_SIZE) > 0) {}
+         handle_loaded_songs();
+      }
+      // A known client is saying something
+      else {
+         handle_client_msg(fd);
       }
    }
 
-   // Select on the normal client sockets to see if they are saying anything
-   config_fd_set_for_normal_traffic();
-   num_connections_available = connection_ready(normal_fds);
-   ASSERT(num_connections_available >= 0);
-   if (num_connections_available) {
-      handle_normal_msg();
-   }
+   // Time out late syncs and start the ones that are due
+   handle_syncs();
 
-   // If the song is playing, fall into the play_song function to send more
-   // notes to the clients.
-   if (song_is_playing) {
+   // If the song is playing (or the inline shard has midi messages due to be
+   // resent), fall into the play_song function to send more notes to the
+   // clients.
+   if (song_is_playing || (num_shards == 0 &&
+            shards[0]->next_deadline(&deadline) && deadline <= clock_now())) {
       state = server::PLAY_SONG;
    }
 }
 
 void Server::init() {
-   file_fd = 0;
    next_client_id = 0;
-   midi_timer = 0;
+   song_start = clock_now();
    memset(buf, '\0', MAX_BUF_SIZE);
 
-   // Overlay the midi header onto the buf for easy dereferencing later.
-   midi_header = (Packet_Header *)buf;
-   buf_offset = 0;
-
    // No song is playing at startup.
    song_is_playing = false;
 
-   // Set the initial sync_client pointer to NULL
-   sync_client = NULL;
+   // Nothing to play until a song is parsed.
+   max_client_delay = 0;
+   song_id = 0;
+   tracks_playing = 0;
+
 
    // Setup main socket for the server to listen for clients on.
    setup_udp_socket();
 
-   // Overlay a Handshake_Packet over the front of the buffer for future use.
-   hs = (Handshake_Packet *)buf;
+   // Setup the shards that send the midi messages.
+   setup_shards();
+
+   // Setup the thread that loads songs off of the disk.
+   next_load_id = 0;
+   pending_load = 0;
+   setup_song_loader();
+
+   // Watch stdin for songs to play. This can fail if stdin was redirected
+   // from a regular file, in which case we just run without user input.
+   stdin_open = reactor.add_fd(STDIN, false);
+   if (!stdin_open) {
+      fprintf(stderr, "Unable to watch stdin, ignoring user input.\n");
+   }
 
-   // Set the sync iterator to the front of the empty clients map
-   sync_it = fd_to_client_info.begin();
+   // Give the song cache its memory budget.
+   song_cache.set_budget((uint64_t)song_cache_mb * 1024 * 1024);
 }
 
-int Server::open_target_file(std::string& target_filename) {
-   // Sync the filesystem to get accurate state.
-   sync();
+int Server::next_wakeup_timeout() {
+   nsec_t timeout = -1;
+   nsec_t deadline;
+   std::unordered_map<int, ClientInfo>::iterator client_it;
 
-   // Check if the file exists.
-   return open(target_filename.c_str(), O_RDONLY, 400);
+   // Wake up in time to notice a sync timing out or a client coming due for
+   // its next one.
+   current_time = clock_now();
+   for (client_it = id_to_client_info.begin();
+         client_it != id_to_client_info.end(); ++client_it) {
+      ClientInfo& info = client_it->second;
+      deadline = info.sync_outstanding ? sync_deadline(info) + 1 :
+         info.next_sync_time;
+      deadline = std::max(deadline - current_time, (nsec_t)0);
+      if (timeout < 0 || deadline < timeout) {
+         timeout = deadline;
+      }
+   }
+
+   // Wake up in time to send the earliest event still queued for an active
+   // client or resend an unacked one (shard threads keep their own time).
+   if (num_shards == 0 &&
+         shards[0]->next_deadline(&deadline)) {
+      deadline = std::max(deadline - current_time, (nsec_t)0);
+      if (timeout < 0 || deadline < timeout) {
+         timeout = deadline;
+      }
+   }
+
+   // The reactor only sleeps in whole milliseconds, round up so we never
+   // wake up just short of a deadline.
+   if (timeout < 0) {
+      return -1;
+   }
+   return (int)nsec_to_msec_ceil(timeout);
 }
 
 bool Server::parse_handshake() {
@@ -691,18 +824,153 @@ bool Server::parse_handshake() {
 }
 
 bool Server::parse_inputs(int num_args, char **arg_list) {
-   if (num_args > 1) {
-      printf("Improper argument count.\n");
-      return false;
-   }
-
    char *endptr;
+   bool port_set = false;
    port = 0;
+   num_shards = 0;
+   send_batch_size = DEFAULT_SEND_BATCH;
+   coalesce_window = 0;
+   lookahead = 0;
+   shared_socket = false;
+   fec = false;
+   midi_format = midi_format::NEWEST;
+   song_cache_mb = DEFAULT_SONG_CACHE_MB;
+   estimator_name = DEFAULT_DELAY_ESTIMATOR;
+   rtt_trace = NULL;
+   DelayEstimator *estimator;
+
+   for (int i = 0; i < num_args; ++i) {
+      if (strcmp(arg_list[i], "-t") == 0) {
+         if (i + 1 >= num_args) {
+            printf("Missing shard thread count.\n");
+            return false;
+         }
+
+         ++i;
+         num_shards = strtol(arg_list[i], &endptr, 10);
+         if (endptr == arg_list[i] || num_shards < 0) {
+            printf("Invalid shard thread count: '%s'\n", arg_list[i]);
+            printf("Shard thread count must be 0 or greater.\n");
+            return false;
+         }
+      }
+      else if (strcmp(arg_list[i], "-b") == 0) {
+         if (i + 1 >= num_args) {
+            printf("Missing send batch size.\n");
+            return false;
+         }
+
+         ++i;
+         send_batch_size = (uint32_t)strtol(arg_list[i], &endptr, 10);
+         if (endptr == arg_list[i] || send_batch_size < 1 ||
+               send_batch_size > MAX_SEND_BATCH) {
+            printf("Invalid send batch size: '%s'\n", arg_list[i]);
+            printf("Send batch size must be between 1 and %d.\n",
+                  MAX_SEND_BATCH);
+            return false;
+         }
+      }
+      else if (strcmp(arg_list[i], "-w") == 0) {
+         if (i + 1 >= num_args) {
+            printf("Missing coalescing window.\n");
+            return false;
+         }
+
+         ++i;
+         coalesce_window = strtol(arg_list[i], &endptr, 10);
+         if (endptr == arg_list[i] || coalesce_window < 0 ||
+               coalesce_window > MAX_COALESCE_WINDOW) {
+            printf("Invalid coalescing window: '%s'\n", arg_list[i]);
+            printf("Coalescing window must be between 0 and %d ms.\n",
+                  MAX_COALESCE_WINDOW);
+            return false;
+         }
+      }
+      else if (strcmp(arg_list[i], "-l") == 0) {
+         if (i + 1 >= num_args) {
+            printf("Missing lookahead.\n");
+            return false;
+         }
+
+         ++i;
+         lookahead = strtol(arg_list[i], &endptr, 10);
+         if (endptr == arg_list[i] || lookahead < 0 ||
+               lookahead > MAX_LOOKAHEAD) {
+            printf("Invalid lookahead: '%s'\n", arg_list[i]);
+            printf("Lookahead must be between 0 and %d ms.\n", MAX_LOOKAHEAD);
+            return false;
+         }
+      }
+      else if (strcmp(arg_list[i], "-m") == 0) {
+         if (i + 1 >= num_args) {
+            printf("Missing song cache size.\n");
+            return false;
+         }
+
+         ++i;
+         song_cache_mb = strtol(arg_list[i], &endptr, 10);
+         if (endptr == arg_list[i] || song_cache_mb < 0) {
+            printf("Invalid song cache size: '%s'\n", arg_list[i]);
+            printf("Song cache size must be 0 MB or greater.\n");
+            return false;
+         }
+      }
+      else if (strcmp(arg_list[i], "-e") == 0) {
+         if (i + 1 >= num_args) {
+            printf("Missing delay estimator.\n");
+            return false;
+         }
+
+         ++i;
+         estimator = make_delay_estimator(arg_list[i]);
+         if (estimator == NULL) {
+            printf("Invalid delay estimator: '%s'\n", arg_list[i]);
+            printf("Delay estimator must be one of %s.\n",
+                  delay_estimator_names());
+            return false;
+         }
+         estimator_name = estimator->name();
+         delete estimator;
+      }
+      else if (strcmp(arg_list[i], "-r") == 0) {
+         if (i + 1 >= num_args) {
+            printf("Missing rtt trace file.\n");
+            return false;
+         }
+
+         ++i;
+         if (rtt_trace != NULL) {
+            fclose(rtt_trace);
+         }
+         rtt_trace = fopen(arg_list[i], "w");
+         if (rtt_trace == NULL) {
+            printf("Unable to open rtt trace file: '%s'\n", arg_list[i]);
+            return false;
+         }
 
-   if (num_args == 1) {
-      port = (uint32_t)strtol(arg_list[0], &endptr, 10);
-      if (endptr == arg_list[0]) {
-         printf("Invalid port: '%s'\n", arg_list[0]);
+         // The server is usually stopped by a signal, so don't let the
+         // trace sit in a buffer.
+         setvbuf(rtt_trace, NULL, _IOLBF, 0);
+      }
+      else if (strcmp(arg_list[i], "-u") == 0) {
+         shared_socket = true;
+      }
+      else if (strcmp(arg_list[i], "-f") == 0) {
+         fec = true;
+      }
+      else if (strcmp(arg_list[i], "-c") == 0) {
+         midi_format = midi_format::FIXED;
+      }
+      else if (!port_set) {
+         port = (uint32_t)strtol(arg_list[i], &endptr, 10);
+         if (endptr == arg_list[i]) {
+            printf("Invalid port: '%s'\n", arg_list[i]);
+            return false;
+         }
+         port_set = true;
+      }
+      else {
+         printf("Improper argument count.\n");
          return false;
       }
    }
@@ -711,68 +979,47 @@ bool Server::parse_inputs(int num_args, char **arg_list) {
 }
 
 bool Server::parse_midi_input(){
-   // Read the midifile from disk
-   midifile.read(filename.c_str());
-
-   // If the midifile is no good, return to previous state.
-   if (!midifile.status()) {
-      fprintf(stderr, "Error reading midifile %s!\n", filename.c_str());
-      return false;
-   }
-
    // If nobody is around to play the song, print error message and get out.
-   if (fd_to_client_info.size() == 0) {
+   if (id_to_client_info.size() == 0) {
       fprintf(stderr, "No clients connected, connect clients to the server "
             "before trying to play a song.\n");
       return false;
    }
 
-   int num_tracks = midifile.getTrackCount();
-
-   MidiEvent midi_event;
-   MyPmEvent pmEvent;
+   int num_tracks = song->num_tracks();
 
    std::unordered_map<int, ClientInfo>::iterator client_it;
-   client_it = fd_to_client_info.begin();
+   client_it = id_to_client_info.begin();
 
-   // Break down the midi file by track and queue up its events.
+   // Hand each track of the song out to the clients.
    for (int track = 0; track < num_tracks; ++track) {
-      std::deque<MyPmEvent> track_deque;
-
-      int track_size = midifile[track].size();
-      // Looping through the track, adding events to its queue
-      for (int event = 0; event < track_size; ++event) {
-         // Make a midi_event so we can extract the midi bytes
-         midi_event = (MidiEvent)midifile[track][event];
-
-         // Making a port midi message based off of the bytes from the
-         // midi_event
-         pmEvent.message[0] = midi_event[0];
-         pmEvent.message[1] = midi_event[1];
-         pmEvent.message[2] = midi_event[2];
-
-         // Making a port midi event which can be sent to port midi to be played
-         // This is a wrapper around the event that just carries the timestamp
-         // to play the event at.
-         pmEvent.timestamp = midifile.getTimeInSeconds(midi_event.tick) * 1000.0;
-
-         // Push the pmEvent onto the deque
-         track_deque.push_back(pmEvent);
-      }
-
-      // Give this track a handle to reference it later by
-      track_queues[track] = track_deque;
+      std::shared_ptr<const TrackEvents> events = song->track(track);
 
       // Reset to front of collection if you hit the end
-      if (client_it == fd_to_client_info.end()) {
-         client_it = fd_to_client_info.begin();
+      if (client_it == id_to_client_info.end()) {
+         client_it = id_to_client_info.begin();
       }
 
       // Assign this track's handle to the next client in round robin fashion
       client_it->second.tracks.push_back(track);
 
       // Add track to appropriate client
-      client_to_track[client_it->second.fd].push_back(track);
+      client_to_track[client_it->second.id].push_back(track);
+
+      // Hand the track's events to the shard of the client playing it.
+      track_to_owner[track] = client_it->second.id;
+      if (events->size()) {
+         ShardCommand command;
+         command.type = shard::TRACK_ADD;
+         command.song = song_id;
+         command.track = track;
+         command.client = client_it->second.id;
+         command.events = events;
+         command.cursor = 0;
+         shard_for(client_it->second)->post_command(command);
+         track_to_shard[track] = client_it->second.id % shards.size();
+         ++tracks_playing;
+      }
 
       // Increment the client iterator to the next client in the collection
       ++client_it;
@@ -781,12 +1028,18 @@ bool Server::parse_midi_input(){
    return true;
 }
 
+void Server::prewarm_songs(std::string& dir) {
+   // The loader compiles the songs in the background and they are cached as
+   // they come in.
+   song_loader->load(loader::DIRECTORY, ++next_load_id, dir);
+}
+
 void Server::print_state() {
    ClientInfo info;
    print_debug("Server state:\n");
-   print_debug("\tfd_to_client_info:\n");
+   print_debug("\tid_to_client_info:\n");
    std::unordered_map<int, ClientInfo>::iterator it;
-   for (it = fd_to_client_info.begin(); it != fd_to_client_info.end(); ++it) {
+   for (it = id_to_client_info.begin(); it != id_to_client_info.end(); ++it) {
       info = it->second;
       print_debug("\t\tfd:        %d\n", info.fd);
       print_debug("\t\tseq_num to send next:   %d\n", info.seq_num);
@@ -798,64 +1051,128 @@ void Server::print_state() {
 }
 
 void Server::print_usage() {
-   printf("Usage: server [remote-port]\n");
+   printf("Usage: server [remote-port] [-t shard-threads] "
+         "[-b send-batch-size] [-w coalesce-window-ms] [-l lookahead-ms] "
+         "[-m song-cache-mb] [-e delay-estimator] [-r rtt-trace-file] "
+         "[-u] [-f] [-c]\n");
+   printf("   -l  send events this far ahead along with when to play them\n");
+   printf("   -e  how client delays are estimated: %s (default %s)\n",
+         delay_estimator_names(), DEFAULT_DELAY_ESTIMATOR);
+   printf("   -r  record every sync round trip (client id, time and rtt in "
+         "ns) for delay_replay\n");
+   printf("   -u  serve every client through the server's socket instead of "
+         "one socket per client\n");
+   printf("   -f  send parity messages to clients losing midi messages so they "
+         "can rebuild\n       them without a resend\n");
+   printf("   -c  send midi events in the fixed 7 byte format instead of the "
+         "compact one\n");
 }
 
-int Server::send_midi_msg(ClientInfo *info) {
-   ASSERT(info != NULL);
-   ASSERT(midi_header->flag == flag::MIDI);
+void Server::publish_client(ClientInfo& info) {
+   nsec_t send_offset = max_client_delay - info.avg_delay;
 
-   // Get the current server wall-clock time.
-   get_current_time(&current_time);
-
-   // Store the seq_num to send time mapping for this message. Note that we are
-   // storing the seq_num + 1 (which is the expected seq_num for the ack to this
-   // message) in the map for easy lookup later.
-   //info->packet_to_send_time[info->seq_num + 1] = current_time;
-
-   // Fire off the packet
-   int bytes_sent = send_buf(info->fd, &info->addr, buf, buf_offset);
-
-   // Reset the offset into the buffer for the next message to build on.
-   buf_offset = 0;
+   if (send_offset == info.published_offset &&
+         max_client_delay == info.published_play_delay &&
+         info.active == info.published_active) {
+      return;
+   }
 
-   // Increment the seq_num so we know what the next packet should go out with
-   info->seq_num += 2;
-   print_debug("setting client %d seq_num to %d\n", info->fd, info->seq_num);
+   ShardCommand command;
+   command.type = shard::CLIENT_UPDATE;
+   command.song = song_id;
+   command.client = info.id;
+   command.fd = info.fd;
+   command.addr = info.addr;
+   command.midi_format = info.midi_format;
+   command.send_offset = send_offset;
+   command.play_delay = max_client_delay;
+   command.active = info.active;
+   shard_for(info)->post_command(command);
+
+   info.published_offset = send_offset;
+   info.published_play_delay = max_client_delay;
+   info.published_active = info.active;
+}
 
-   return bytes_sent;
+void Server::publish_all_clients() {
+   std::unordered_map<int, ClientInfo>::iterator it;
+   for (it = id_to_client_info.begin(); it != id_to_client_info.end(); ++it) {
+      publish_client(it->second);
+   }
 }
 
 void Server::send_sync_packet(ClientInfo& info) {
    int result;
-
-   // Rebuild the packet to the client
-   memset(buf, '\0', MAX_BUF_SIZE);
-   midi_header->seq_num = info.seq_num;
-   midi_header->flag = flag::SYNC;
+   uint32_t len;
+   Sync_Packet sync;
+
+   // Set the send time in the ClientInfo struct, and number the sync so
+   // its ack can be told apart from late acks to earlier ones.
+   info.last_msg_send_time = clock_now();
+   info.sync_outstanding = true;
+   ++info.sync_seq;
+
+   // Rebuild the packet to the client, letting it know where our clock is at
+   // so it can line its clock up with ours.
+   memset(&sync, '\0', sizeof(Sync_Packet));
+   sync.header.seq_num = info.seq_num;
+   sync.header.flag = flag::SYNC;
+   sync.sync_seq = info.sync_seq;
+   sync.t1 = info.last_msg_send_time;
+   sync.clock_offset = info.clock_offset;
+   sync.offset_time = info.offset_time;
+   sync.skew_ppb = (int64_t)(info.clock_skew * 1e9);
+   sync.offset_valid = info.offset_valid;
+   len = encode_packet(sync, buf, MAX_BUF_SIZE);
 
    // Send sync packet to client
-   result = send_buf(info.fd, &info.addr, buf, sizeof(Packet_Header));
-   ASSERT(result == sizeof(Packet_Header));
+   result = send_buf(info.fd, &info.addr, buf, len);
+   ASSERT(result == (int)len);
+}
 
-   // Set the send time in the ClientInfo struct
-   get_current_time(&(info.last_msg_send_time));
+Shard *Server::shard_for(ClientInfo& info) {
+   return shards[info.id % shards.size()];
 }
 
-void Server::setup_midi_msg(ClientInfo *info) {
-   ASSERT(info != NULL);
-   midi_header->seq_num = info->seq_num;
-   midi_header->flag = flag::MIDI;
-   midi_header->num_midi_events = 0;
-   buf_offset = sizeof(Packet_Header);
+void Server::setup_shards() {
+   // Without shard threads a single shard is serviced inline by the control
+   // thread.
+   if (num_shards == 0) {
+      shards.push_back(new Shard(0, -1, send_batch_size, coalesce_window,
+               lookahead, fec));
+      return;
+   }
+
+   // The shard threads poke this pipe whenever they have replies for us.
+   ASSERT(pipe(shard_pipe) == 0);
+   set_nonblocking(shard_pipe[0]);
+   set_nonblocking(shard_pipe[1]);
+   ASSERT(reactor.add_fd(shard_pipe[0], true));
+
+   for (int i = 0; i < num_shards; ++i) {
+      shards.push_back(new Shard(i, shard_pipe[1], send_batch_size,
+               coalesce_window, lookahead, fec));
+      shards.back()->start();
+   }
+   printf("Server is using %d shard threads\n", num_shards);
+}
+
+void Server::setup_song_loader() {
+   // The loader pokes this pipe whenever it has finished loading something.
+   ASSERT(pipe(loader_pipe) == 0);
+   set_nonblocking(loader_pipe[0]);
+   set_nonblocking(loader_pipe[1]);
+   ASSERT(reactor.add_fd(loader_pipe[0], true));
+
+   song_loader = new SongLoader(loader_pipe[1]);
+   song_loader->start();
 }
 
 void Server::setup_udp_socket() {
    // Create the main socket the server will listen for clients on.
    server_sock = socket(AF_INET, SOCK_DGRAM, 0);
    ASSERT(server_sock >= 0);
-
-   max_sock = server_sock;
+   set_nonblocking(server_sock);
 
    local.sin_family = AF_INET;                  // IPv4
    local.sin_addr.s_addr = htonl(INADDR_ANY);   // Match any IP
@@ -880,46 +1197,182 @@ void Server::setup_udp_socket() {
    port = ntohs(local.sin_port);
 
    printf("Server is using port %d\n", port);
+
+   // Register the socket once, the reactor reports new handshakes from here
+   // on out.
+   ASSERT(reactor.add_fd(server_sock, true));
+}
+
+void Server::start_song() {
+   ShardCommand command;
+   std::vector<Shard *>::iterator shard_it;
+
+   // Let the shards know where the song's clock starts before any of its
+   // tracks show up.
+   song_start = clock_now();
+   command.type = shard::SONG_START;
+   command.song = song_id;
+   command.start = song_start;
+   for (shard_it = shards.begin(); shard_it != shards.end(); ++shard_it) {
+      (*shard_it)->post_command(command);
+   }
+
+   // Hand the song's tracks out to the clients, moving to the play_song state
+   // if that worked.
+   if (parse_midi_input()) {
+      state = server::PLAY_SONG;
+
+      // Set the flag so we know a song is playing in the WAIT_FOR_INPUT
+      // state.
+      song_is_playing = true;
+   }
+   else {
+      fprintf(stderr, "Midi song no good!\n");
+      state = server::WAIT_FOR_INPUT;
+   }
 }
 
-void Server::set_timeval(uint32_t timeout) {
-   tv.tv_sec = timeout;
-   tv.tv_usec = 0;
+void Server::stop_song() {
+   ShardCommand command;
+   std::unordered_map<int, ClientInfo>::iterator client_it;
+   std::vector<Shard *>::iterator shard_it;
+
+   // Bump the song id so anything still in flight for the old song is
+   // recognized as stale.
+   ++song_id;
+   command.type = shard::SONG_STOP;
+   command.song = song_id;
+   for (shard_it = shards.begin(); shard_it != shards.end(); ++shard_it) {
+      (*shard_it)->post_command(command);
+   }
+
+   // Forget the old song's track assignments.
+   for (client_it = id_to_client_info.begin();
+         client_it != id_to_client_info.end(); ++client_it) {
+      client_it->second.tracks.clear();
+   }
+   client_to_track.clear();
+   track_to_shard.clear();
+   track_to_owner.clear();
+   tracks_playing = 0;
+   song_is_playing = false;
+}
+
+nsec_t Server::sync_deadline(ClientInfo& info) {
+   return info.last_msg_send_time + std::max(MAX_SYNC_TIMEOUT *
+         info.avg_delay, msec_to_nsec(MIN_SYNC_TIMEOUT_MS));
 }
 
-void Server::sync_next() {
-   // Move the sync_it to the next client and sync
-   ++sync_it;
-   if (sync_it == fd_to_client_info.end()) {
-      max_client_delay = 0;
+void Server::update_clock_offset(ClientInfo& info, SyncSample& sample) {
+   std::deque<SyncSample>::iterator it;
+   std::deque<SyncSample>::iterator best;
 
-      // Update the max_client_delay to be the maximum delay amongst clients
-      // in the network.
-      for (sync_it = fd_to_client_info.begin();
-            sync_it != fd_to_client_info.end(); ++sync_it) {
-         if (sync_it->second.avg_delay > max_client_delay &&
-              sync_it->second.active) {
-            max_client_delay = sync_it->second.avg_delay;
-         }
+   info.sync_samples.push_back(sample);
+   if (info.sync_samples.size() > NUM_OFFSET_SAMPLES) {
+      info.sync_samples.pop_front();
+   }
+
+   // Queueing only ever adds delay, and usually on one leg of the trip more
+   // than the other, so the quickest exchange gives the truest offset.
+   best = info.sync_samples.begin();
+   for (it = info.sync_samples.begin(); it != info.sync_samples.end(); ++it) {
+      if (it->delay < best->delay) {
+         best = it;
       }
-      get_current_time(&current_time);
-      fprintf(stderr, "%lu, %lu\n", current_time, max_client_delay);
-      // fprintf(stderr, "max_client_delay: %lu\n", max_client_delay);
-      print_debug("max_client_delay: %lu\n", max_client_delay);
+   }
 
-      // Reset the iterator to the front of the list
-      sync_it = fd_to_client_info.begin();
+   // Syncs come around far more often than the clocks drift measurably, so
+   // only the quickest exchange every so often goes into the skew fit.
+   if (info.skew_samples.empty() || (best->time > info.skew_samples.back().time
+            && sample.time - info.skew_samples.back().time >=
+            msec_to_nsec(SKEW_SAMPLE_MS))) {
+      info.skew_samples.push_back(*best);
+      if (info.skew_samples.size() > NUM_SKEW_SAMPLES) {
+         info.skew_samples.pop_front();
+      }
+      update_clock_skew(info);
    }
 
-   sync_client = &(sync_it->second);
-  //  fprintf(stderr, "sync_client: %d\n", sync_client->fd);
+   // The best sample may be a few syncs old, so carry its offset forward
+   // to now by the skew.
+   info.offset_time = sample.time;
+   info.clock_offset = best->offset + (nsec_t)(info.clock_skew *
+         (double)(sample.time - best->time));
+   info.offset_valid = true;
+   print_debug("client %d's clock offset: %ld ns (rtt %ld ns)\n", info.fd,
+         info.clock_offset, best->delay);
 }
 
-void process_midi(PtTimestamp timestamp, void *userData) {
-   // Lookup the time and populate the server's clock
-   ((Server *)userData)->midi_timer = Pt_Time();
+void Server::update_clock_skew(ClientInfo& info) {
+   std::deque<SyncSample>::iterator it;
+   double mean_time = 0;
+   double mean_offset = 0;
+   double covariance = 0;
+   double variance = 0;
+   double skew;
+   nsec_t origin;
+
+   // A short baseline can't tell drift from jitter, so assume no skew until
+   // the exchanges span long enough.
+   if (info.skew_samples.size() < 2 ||
+         info.skew_samples.back().time - info.skew_samples.front().time <
+         msec_to_nsec(MIN_SKEW_SPAN_MS)) {
+      info.clock_skew = 0;
+      return;
+   }
+
+   // Least squares fit of offset against time. Times are taken relative to
+   // the first sample so the doubles keep their precision.
+   origin = info.skew_samples.front().time;
+   for (it = info.skew_samples.begin(); it != info.skew_samples.end(); ++it) {
+      mean_time += (double)(it->time - origin);
+      mean_offset += (double)it->offset;
+   }
+   mean_time /= info.skew_samples.size();
+   mean_offset /= info.skew_samples.size();
+
+   for (it = info.skew_samples.begin(); it != info.skew_samples.end(); ++it) {
+      covariance += ((double)(it->time - origin) - mean_time) *
+         ((double)it->offset - mean_offset);
+      variance += ((double)(it->time - origin) - mean_time) *
+         ((double)(it->time - origin) - mean_time);
+   }
+
+   skew = covariance / variance;
+   if (skew > MAX_SKEW_PPM / 1e6 || skew < -MAX_SKEW_PPM / 1e6) {
+      print_debug("Ignoring client %d's clock skew of %f ppm\n", info.fd,
+            skew * 1e6);
+      return;
+   }
+
+   info.clock_skew = skew;
+   print_debug("client %d's clock skew: %f ppm\n", info.fd, skew * 1e6);
+}
 
-   //  fprintf(stderr, "value pt_time: %d\n", ((Server *)userData)->midi_timer);
+void Server::update_max_client_delay(ClientInfo& info) {
+   nsec_t old_max = max_client_delay;
+
+   // Only active clients hold up the max.
+   if (info.active) {
+      client_delays.update(info.id, info.avg_delay);
+   }
+   else {
+      client_delays.remove(info.id);
+   }
+   max_client_delay = client_delays.empty() ? 0 : client_delays.top().delay;
+
+   // Every client's send offset depends on the max delay, otherwise only
+   // this client's moved.
+   if (max_client_delay != old_max) {
+      current_time = clock_now();
+      fprintf(stderr, "%lu, %lu\n", nsec_to_msec(current_time),
+            nsec_to_msec(max_client_delay));
+      print_debug("max_client_delay: %lu\n", max_client_delay);
+      publish_all_clients();
+   }
+   else {
+      publish_client(info);
+   }
 }
 
 void Server::wait_for_handshake() {
@@ -5,15 +5,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <deque>
+#include <memory>
 #include <string>
 #include <string.h>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 #include "network/network.hpp"
+#include "network/reactor.hpp"
 #include "midifile/include/MidiFile.h"
 //#include "midifile/include/Options.h"
 #include "portmidi/include/portmidi.h"
 #include "portmidi/include/porttime.h"
+#include "server/addr_table.hpp"
+#include "server/delay_estimator.hpp"
+#include "server/delay_heap.hpp"
+#include "server/shard.hpp"
+#include "server/song.hpp"
+#include "server/song_cache.hpp"
+#include "server/song_loader.hpp"
 
 #define NUM_SYNC_TRIALS   3   // Number of times to sync with a client to
                               // established an avg. delay profile.
@@ -22,11 +32,39 @@
                               // with a client before declaring the client
                               // inactive
 
-#define NUM_DELAY_SAMPLES 3   // Number of delay times each client keeps track
-                              // of when computing average delay.
+#define MIN_SYNC_TIMEOUT_MS 50 // Shortest time (ms) to wait on a sync ack, so
+                               // clients with tiny delays don't time out on
+                               // ordinary jitter.
+
+#define SYNC_PERIOD_MS 100    // Pause (ms) between a client's sync sessions.
+
+#define NUM_OFFSET_SAMPLES 8  // Number of sync exchanges each client's clock
+                              // offset is picked from.
+
+#define NUM_SKEW_SAMPLES 64   // Number of sync exchanges each client's clock
+                              // skew is fit to.
+
+#define SKEW_SAMPLE_MS 250    // Sync exchanges are picked for the skew fit at
+                              // most this often (ms) to get a long baseline.
+
+#define MIN_SKEW_SPAN_MS 2000 // Shortest span of sync exchanges (ms) a clock
+                              // skew is fit to.
+
+#define MAX_SKEW_PPM 500      // Largest believable clock skew (ppm), anything
+                              // beyond is noise.
+
+// Clock offset and round trip delay measured by one sync exchange.
+typedef struct SyncSample {
+   nsec_t time;      // Server's clock halfway through the exchange.
+   nsec_t offset;    // Client's clock minus the server's clock.
+   nsec_t delay;     // Round trip delay, less the client's turnaround time.
+} SyncSample;
 
 class ClientInfo {
    public:
+      // Id the server assigned the client (used to pick the client's shard)
+      int id;
+
       // Client's socket fd
       int fd;
 
@@ -36,31 +74,59 @@ class ClientInfo {
       // Client's socket address information
       sockaddr_in addr;
 
+      // Wire format (a midi_format::Midi_Format) of the client's midi events
+      uint8_t midi_format;
+
       // Current sequence number to send next for this client
       uint32_t seq_num;
 
       // The expected next sequence number from the client
       uint32_t expected_seq_num;
 
-      // The average delay of this client (used for syncing with other clients)
-      long avg_delay;
+      // The estimated delay (ns) of this client (used for syncing with other
+      // clients)
+      nsec_t avg_delay;
+
+      // Turns the client's measured delays into avg_delay.
+      DelayEstimator *delay_estimator;
+
+      // The send offset, play delay and active flag last published to the
+      // client's shard.
+      nsec_t published_offset;
+      nsec_t published_play_delay;
+      bool published_active;
 
       // The time the last sync message was sent to the client
-      long last_msg_send_time;
+      nsec_t last_msg_send_time;
 
-      // A temp variable to hold syncing values (which are averaged before putting
-      // them into the delay_times deque).
-      long session_delay;
+      // Number of the last sync sent to the client, only an ack carrying it
+      // counts while sync_outstanding.
+      uint32_t sync_seq;
+      bool sync_outstanding;
+
+      // When to start the client's next sync session.
+      nsec_t next_sync_time;
 
       // A counter to determine how many times to send sync packets per sync
       // session.
       int session_delay_counter;
 
-      // The number of successful syncs the client has had this go around.
-      int sync_counter;
+      // The most recent sync exchanges with the client.
+      std::deque<SyncSample> sync_samples;
+
+      // The sync exchanges the client's clock skew is fit to, the quickest
+      // one every SKEW_SAMPLE_MS.
+      std::deque<SyncSample> skew_samples;
+
+      // Client's clock minus the server's clock as of offset_time, taken from
+      // the sync sample with the smallest round trip (the one least skewed by
+      // queueing) and carried forward by the clock skew.
+      nsec_t clock_offset;
+      nsec_t offset_time;
+      bool offset_valid;
 
-      // Container of sync times which can be averaged.
-      std::deque<long> delay_times;
+      // How fast the client's clock runs against the server's (ns per ns).
+      double clock_skew;
 
       // Tracks this client is responsible for playing (the server uses this to
       // figure out who to send tracks to).
@@ -68,28 +134,41 @@ class ClientInfo {
 
       //std::unordered_map<uint32_t, long> packet_to_send_time;
 
-      ClientInfo() {}
+      ClientInfo() {
+         delay_estimator = NULL;
+      }
 
-      ~ClientInfo() {}
+      ~ClientInfo() {
+         delete delay_estimator;
+      }
 
       ClientInfo(const ClientInfo& other) {
+         id = other.id;
          fd = other.fd;
          active = other.active;
          addr.sin_family = other.addr.sin_family;
          addr.sin_port = other.addr.sin_port;
          addr.sin_addr = other.addr.sin_addr;
+         midi_format = other.midi_format;
          seq_num = other.seq_num;
          expected_seq_num = other.expected_seq_num;
          avg_delay = other.avg_delay;
+         delay_estimator = other.delay_estimator ?
+            other.delay_estimator->clone() : NULL;
+         published_offset = other.published_offset;
+         published_play_delay = other.published_play_delay;
+         published_active = other.published_active;
          last_msg_send_time = other.last_msg_send_time;
-         session_delay = other.session_delay;
+         sync_seq = other.sync_seq;
+         sync_outstanding = other.sync_outstanding;
+         next_sync_time = other.next_sync_time;
          session_delay_counter = other.session_delay_counter;
-         sync_counter = other.sync_counter;
-         std::deque<long>::const_iterator delay_it;
-         for (delay_it = other.delay_times.begin();
-               delay_it != other.delay_times.end(); ++delay_it) {
-            delay_times.push_back(*delay_it);
-         }
+         sync_samples = other.sync_samples;
+         skew_samples = other.skew_samples;
+         clock_offset = other.clock_offset;
+         offset_time = other.offset_time;
+         offset_valid = other.offset_valid;
+         clock_skew = other.clock_skew;
          std::vector<int>::const_iterator tracks_it;
          for (tracks_it = other.tracks.begin();
                tracks_it != other.tracks.end(); ++tracks_it) {
@@ -98,28 +177,37 @@ class ClientInfo {
       }
 
       ClientInfo& operator=(ClientInfo other) {
+         id = other.id;
          fd = other.fd;
          active = other.active;
          addr.sin_family = other.addr.sin_family;
          addr.sin_port = other.addr.sin_port;
          addr.sin_addr = other.addr.sin_addr;
+         midi_format = other.midi_format;
          seq_num = other.seq_num;
          expected_seq_num = other.expected_seq_num;
          avg_delay = other.avg_delay;
+         std::swap(delay_estimator, other.delay_estimator);
+         published_offset = other.published_offset;
+         published_play_delay = other.published_play_delay;
+         published_active = other.published_active;
          last_msg_send_time = other.last_msg_send_time;
-         session_delay = other.session_delay;
+         sync_seq = other.sync_seq;
+         sync_outstanding = other.sync_outstanding;
+         next_sync_time = other.next_sync_time;
          session_delay_counter = other.session_delay_counter;
-         sync_counter = other.sync_counter;
-         std::deque<long>::iterator delay_it;
-         for (delay_it = other.delay_times.begin();
-               delay_it != other.delay_times.end(); ++delay_it) {
-            delay_times.push_back(*delay_it);
-         }
+         sync_samples = other.sync_samples;
+         skew_samples = other.skew_samples;
+         clock_offset = other.clock_offset;
+         offset_time = other.offset_time;
+         offset_valid = other.offset_valid;
+         clock_skew = other.clock_skew;
          std::vector<int>::iterator tracks_it;
          for (tracks_it = other.tracks.begin();
                tracks_it != other.tracks.end(); ++tracks_it) {
             tracks.push_back(*tracks_it);
          }
+         return *this;
       }
 };
 
@@ -127,81 +215,102 @@ namespace server {
    enum State { HANDSHAKE, WAIT_FOR_INPUT, PARSE_SONG, PLAY_SONG, SONG_FIN, DONE };
 };
 
-void process_midi(PtTimestamp timestamp, void *userData);
-
 class Server {
    private:
       uint32_t port;              // The server's port.
 
       int server_sock;            // Server's socket fd.
-      int max_sock;               // Maximum server socket number.
       sockaddr_in local;          // Local socket config.
-      fd_set normal_fds;          // Set of fds to for normal messages.
-      fd_set priority_fds;        // Set of fds for priority messages.
-      struct timeval tv;          // Timeval for select.
+      Reactor reactor;            // Event loop for stdin and all sockets.
+      bool stdin_open;            // False once stdin hits EOF.
 
-      int file_fd;                // File descriptor to the song file to read/play
       std::string filename;       // Name of the song file to read/play
       uint8_t buf[MAX_BUF_SIZE];  // Temporary buffer to hold a received packet.
-      uint64_t buf_offset;        // Offset to index into the buffer with.
+      RecvBatch recv_batch;       // Packets read off a socket in one go.
 
-      Handshake_Packet *hs;       // Overlay on top of the buffer.
-      Packet_Header *midi_header; // Overlay on top of the buffer.
       int next_client_id;         // The id to be assigned to the next client.
       bool song_is_playing;       // Tells the state machine we are playing a song
 
       server::State state;        // Current state of the Server's state machine.
-      MidiFile midifile;          // Midifile object to parse midi data
-      PtError time_error;         // Time error
-      long max_client_delay;      // The current max delay from any client
-      long current_time;          // Variable to hold the current time
-
-      ClientInfo *sync_client;    // Client that is currently being synced.
-
-      // Iterator which decides which client to try and sync with at any given
-      // time.
-      std::unordered_map<int, ClientInfo>::iterator sync_it;
-
-      // Mapping of client socket fd to the client's ClientInfo struct.
-      std::unordered_map<int, ClientInfo> fd_to_client_info;
-
-      // Mapping of tracks to their queue of events to be played.
-      std::unordered_map<int, std::deque<MyPmEvent> > track_queues;
+      std::shared_ptr<Song> song; // The compiled tracks of the current song.
+      SongCache song_cache;       // Songs compiled for earlier plays.
+      long song_cache_mb;         // Memory budget of the song cache.
+      SongLoader *song_loader;    // Loads songs off of the disk.
+      int loader_pipe[2];         // The song loader pokes this with results.
+      uint32_t next_load_id;      // Id of the last request to the loader.
+      uint32_t pending_load;      // Load that plays once done (0 if none).
+      nsec_t song_start;          // When the current song started.
+      nsec_t max_client_delay;    // The current max delay from any client
+      nsec_t current_time;        // Variable to hold the current time
+      std::string estimator_name; // Delay estimator every client gets.
+      FILE *rtt_trace;            // Sync round trips are recorded here (NULL
+                                  // if they aren't).
+
+      // Mapping of client id to the client's ClientInfo struct.
+      std::unordered_map<int, ClientInfo> id_to_client_info;
+
+      // Mapping of client socket fd to the client's id (unused when clients
+      // share the server's socket).
+      std::unordered_map<int, int> fd_to_client_id;
+
+      // Mapping of client socket address to the client's id.
+      AddrTable addr_to_client_id;
+
+      // Delays of the active clients, the largest one is max_client_delay.
+      DelayHeap client_delays;
+
+      bool shared_socket;         // True if all clients use server_sock.
+      bool fec;                   // True if lossy clients get parity.
+      uint8_t midi_format;        // Newest midi format sent to clients.
+
+      int num_shards;             // Number of shard threads (0 runs inline).
+      uint32_t send_batch_size;   // Midi messages a shard sends per syscall.
+      long coalesce_window;       // Events due within this many ms of each
+                                  // other share a client's packets.
+      long lookahead;             // How far ahead (ms) events are sent.
+      int shard_pipe[2];          // Shard threads poke this when they reply.
+      uint32_t song_id;           // Id of the current song sent to shards.
+      int tracks_playing;         // Tracks with events left to send.
+
+      // The shards which send midi messages to the clients. Clients (and the
+      // tracks they play) are partitioned across them by client id.
+      std::vector<Shard *> shards;
+
+      // Mapping of tracks to the shard holding them (-1 while a track is
+      // being moved between shards).
+      std::unordered_map<int, int> track_to_shard;
+
+      // Mapping of tracks to the id of the client that should play them.
+      std::unordered_map<int, int> track_to_owner;
 
       // Records the intial track to mappings, used for track recovery when
       // client crashes.
       std::unordered_map<int, std::vector<int> > client_to_track;
 
-      // Appends the event to the buffer, incrementing the number of midi
-      // messages in the buffer's midi_header.
-      void append_to_buf(MyPmEvent *event);
-
-      // computehandle_plays delay profile times in the delay times vector
-      void calc_delay(ClientInfo &client);
-
-      // Configures the fd_set to contain all normal traffic.
-      void config_fd_set_for_normal_traffic();
-
-      // Configures the fd_set for priority traffic
-      void config_fd_set_for_priority_traffic();
-
-      // Configures the fd_set to contain the server_sock.
-      void config_fd_set_for_server_socket();
-
-      // Configures the fd_set to contain the stdin.
-      void config_fd_set_for_stdin();
-
-      // Checks to see if there are any available connections.
-      int connection_ready(fd_set fds);
+      // Hands the track to the client, moving it to the client's shard if
+      // needed.
+      void assign_track(int track, ClientInfo& owner);
 
       // Handles aborting the server.
       void handle_abort();
 
-      // Handles any message sent from the client to the server.
-      void handle_client_packet(int fd);
+      // Handles a single packet of len bytes from the client based on its
+      // flag.
+      void handle_client_datagram(ClientInfo& info, uint8_t *packet,
+            uint32_t len);
+
+      // Drains every packet the client at fd has sent, dispatching each one
+      // based on its flag.
+      void handle_client_msg(int fd);
+
+      // Hands the client's ack of midi message seq_num (which it rebuilt
+      // from parity if recovered) to the shard that sent it.
+      void handle_client_packet(ClientInfo& info, uint32_t seq_num,
+            bool recovered);
 
-      // Determines what the delay of the client is.
-      void handle_client_timing(ClientInfo& info);
+      // Determines what the delay and clock offset of the client are from
+      // its SYNC_ACK.
+      void handle_client_timing(ClientInfo& info, Sync_Packet& sync);
 
       // Cleanup after the file transfer.
       void handle_done();
@@ -209,11 +318,12 @@ class Server {
       // Handles the handshake portion of the file transfer.
       void handle_handshake();
 
-      // Handle a new client that has connected to the server.
-      void handle_new_client();
+      // Caches every song the loader has finished and starts the one the
+      // user asked to play.
+      void handle_loaded_songs();
 
-      // Handle a normal message from the client.
-      void handle_normal_msg();
+      // Handle a new client whose handshake packet was received.
+      void handle_new_client(Batch_Packet *packet);
 
       // Parses the midi song, breaking it down into subsequent tracks and
       // assigning those tracks to clients for playing.
@@ -223,8 +333,12 @@ class Server {
       // out to the client(s).
       void handle_play_song();
 
-      // Handle a priority message from the client.
-      void handle_priority_msg();
+      // Handles every packet waiting on the server socket, both handshakes
+      // and packets from clients sharing the socket.
+      void handle_server_msg();
+
+      // Applies every reply the shards have posted.
+      void handle_shard_replies();
 
       // Handles the end of a song (if we want to do this still).
       void handle_song_fin();
@@ -235,6 +349,10 @@ class Server {
       // Handles the case where a client misses its sync window.
       void handle_sync_timeout(ClientInfo *info);
 
+      // Times out the syncs whose acks are overdue and starts the sync
+      // sessions that are due, for every client at once.
+      void handle_syncs();
+
       // Handles the state where the client is waiting for an event to occur
       // (either a midi event is ready to be sent or a client has responded
       // / connected).
@@ -243,8 +361,9 @@ class Server {
       // Initialize all variables in the Server object to default values.
       void init();
 
-      // Returns true if the specified local file for writing was opened.
-      int open_target_file(std::string& target_filename);
+      // Returns the number of milliseconds the server can sleep before the
+      // next midi event or sync timeout is due (-1 if nothing is pending).
+      int next_wakeup_timeout();
 
       // Parses a handshake packet and returns true if it is valid.
       bool parse_handshake();
@@ -255,37 +374,66 @@ class Server {
       // Parses the midi song to determine if valid
       bool parse_midi_input();
 
+      // Has the song loader load every midi file in the directory into the
+      // song cache.
+      void prewarm_songs(std::string& dir);
+
       // Prints the state of the server's priority_message deque and the
-      // fd_to_client_info map.
+      // id_to_client_info map.
       void print_state();
 
       // Prints the usage message specifying the input arguments to the Server
       // constructor.
       void print_usage();
 
+      // Sends the client's send offset and state to its shard if they
+      // changed since the last time they were published.
+      void publish_client(ClientInfo& info);
+
+      // Publishes every client, ie. after max_client_delay changed.
+      void publish_all_clients();
+
       // The main state machine loop for the server.
       void ready_go();
 
-      // Sends the content in the buffer to the client at the specified socket.
-      int send_midi_msg(ClientInfo *info);
-
       // Sends a sync packet to the client specified by the ClientInfo struct,
       // incrementing its seq_num count and setting the last_msg_send_time field
       // to the current time.
       void send_sync_packet(ClientInfo& info);
 
-      // Sets up the buffer as a midi message to the specified client.
-      void setup_midi_msg(ClientInfo *);
+      // Returns the shard responsible for the client.
+      Shard *shard_for(ClientInfo& info);
+
+      // Creates the shards (and their threads if num_shards > 0).
+      void setup_shards();
+
+      // Creates and starts the song loader thread.
+      void setup_song_loader();
 
       // Sets up the server's socket to receive connections on.
       void setup_udp_socket();
 
-      // Sets the timeval struct tv to have timeout number of seconds.
-      void set_timeval(uint32_t timeout);
+      // Hands the tracks of the current song out and starts playing it.
+      void start_song();
 
-      // Move the sync_it to the next viable client and compute the overall
-      // max delay amongst clients if needed.
-      void sync_next();
+      // Stops the current song on every shard and forgets its tracks.
+      void stop_song();
+
+      // Returns when the sync in flight to the client times out.
+      nsec_t sync_deadline(ClientInfo& info);
+
+      // Adds a sync sample to the client's recent ones and takes the clock
+      // offset measured over the smallest round trip among them.
+      void update_clock_offset(ClientInfo& info, SyncSample& sample);
+
+      // Fits a line through the client's clock offsets over time, taking its
+      // slope as the client's clock skew.
+      void update_clock_skew(ClientInfo& info);
+
+      // Folds a change in the client's delay (or activity) into the delay
+      // heap and max_client_delay, publishing whichever clients' send
+      // offsets moved.
+      void update_max_client_delay(ClientInfo& info);
 
       // Waits 10 seconds for a handshake packet to come in. If one does
       // arrive, the packet is parsed and the state of the file transfer
@@ -304,8 +452,6 @@ class Server {
       //
 
    public:
-      PtTimestamp midi_timer;     // Midi timer (int32_t)
-
       // Base constructor, takes in a list of arguments and their count to be
       // parsed and used for the filetransfer.
       Server(int num_args, char **arg_list);
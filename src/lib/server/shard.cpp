@@ -0,0 +1,878 @@
+#include <errno.h>            // errno
+#include <sched.h>            // sched_yield
+#include <unistd.h>           // usleep, write
+#include <algorithm>
+#include "network/wire.hpp"
+#include "server/shard.hpp"
+
+// Orders tracks by client, so all of a client's tracks are serviced together.
+static bool lower_client(const ScheduledTrack& a, const ScheduledTrack& b) {
+   return a.client < b.client;
+}
+
+// Orders sent messages by sequence number.
+static bool lower_seq_num(const SentPacket& packet, uint32_t seq_num) {
+   return packet.seq_num < seq_num;
+}
+
+// Returns true if the event is a note off (or a note on with no velocity,
+// which means the same thing).
+static bool is_note_off(const MyPmEvent& event) {
+   return (event.message[0] & 0xF0) == 0x80 ||
+      ((event.message[0] & 0xF0) == 0x90 && event.message[2] == 0);
+}
+
+Shard::Shard(int id, int notify_fd, uint32_t batch_size, long coalesce_window,
+      long lookahead, bool fec) : id(id), notify_fd(notify_fd), running(false),
+      batch(batch_size), coalesce_window(msec_to_nsec(coalesce_window)),
+      lookahead(msec_to_nsec(lookahead)), fec(fec) {
+   // The buffer points into the batch once a message is being built.
+   buf = NULL;
+   buf_offset = 0;
+   msg_last_play = 0;
+   msg_note_off = false;
+   msg_sysex = false;
+
+   song = 0;
+   song_start = 0;
+   schedule_dirty = false;
+   service_time = 0;
+   next_resend = -1;
+   next_parity = -1;
+   max_msg_len = fec ? MAX_MIDI_PACKET - sizeof(Parity_Header) :
+      MAX_MIDI_PACKET;
+   sysex_waiting = false;
+   sysex_ready = false;
+}
+
+Shard::~Shard() {
+   stop();
+}
+
+void Shard::ack_packet(int client_id, uint32_t seq_num, bool recovered) {
+   std::unordered_map<int, ShardClient>::iterator client_it;
+   std::deque<SentPacket>::iterator packet_it;
+   ShardClient *client;
+
+   client_it = clients.find(client_id);
+   if (client_it == clients.end()) {
+      return;
+   }
+   client = &(client_it->second);
+
+   // Acks for messages that already left the window (or were acked before)
+   // are duplicates.
+   packet_it = std::lower_bound(client->window.begin(), client->window.end(),
+         seq_num, lower_seq_num);
+   if (packet_it == client->window.end() || packet_it->seq_num != seq_num ||
+         packet_it->done) {
+      return;
+   }
+   packet_it->done = true;
+   ++client->packets_acked;
+   if (recovered) {
+      ++client->packets_recovered;
+   }
+   record_loss(*client, recovered || packet_it->resends > 0);
+
+   while (!client->window.empty() && client->window.front().done) {
+      client->window.pop_front();
+   }
+
+   if (!client->sysex_queue.empty() &&
+         client->window.size() < SEND_WINDOW_SIZE) {
+      sysex_ready = true;
+   }
+}
+
+void Shard::add_to_parity(ShardClient *client,
+      const std::vector<uint8_t>& data) {
+   // The first message of a group sets how long the group can stay open.
+   if (client->fec_seq_nums.empty()) {
+      client->fec_parity.clear();
+      client->fec_len_xor = 0;
+      client->fec_deadline = service_time + msec_to_nsec(FEC_MAX_WAIT_MS);
+      if (next_parity < 0 || client->fec_deadline < next_parity) {
+         next_parity = client->fec_deadline;
+      }
+   }
+
+   if (client->fec_parity.size() < data.size()) {
+      client->fec_parity.resize(data.size(), 0);
+   }
+   for (uint32_t i = 0; i < data.size(); ++i) {
+      client->fec_parity[i] ^= data[i];
+   }
+   client->fec_len_xor ^= (uint16_t)data.size();
+   client->fec_seq_nums.push_back(client->seq_num);
+
+   if (client->fec_seq_nums.size() >= client->fec_group) {
+      send_parity(*client);
+   }
+}
+
+void Shard::append_to_buf(ShardClient *client, const MyPmEvent *event) {
+   ASSERT(client != NULL);
+   ASSERT(event != NULL);
+
+   // Start a new message if the count in the header or the packet would
+   // overflow.
+   if (buf != NULL && (msg_header.header.num_midi_events >= MAX_MIDI_EVENTS ||
+            buf_offset + MAX_ENCODED_EVENT > max_msg_len)) {
+      send_midi_msg(client);
+   }
+   if (buf == NULL) {
+      setup_midi_msg(client);
+   }
+
+   ASSERT(msg_header.header.flag == flag::MIDI ||
+         msg_header.header.flag == flag::MIDI_TIMED);
+   buf_offset += encoder.encode(*event, buf + buf_offset);
+   ++msg_header.header.num_midi_events;
+
+   // Remember what it takes for the message to be worth resending.
+   msg_last_play = std::max(msg_last_play, song_start +
+         msec_to_nsec(event->timestamp) + client->play_delay);
+   msg_note_off = msg_note_off || is_note_off(*event);
+}
+
+void Shard::append_sysex(ShardClient *client,
+      const std::shared_ptr<const TrackEvents>& events,
+      const MyPmEvent *event, const uint8_t *data, uint32_t len) {
+   PendingSysex pending;
+
+   ASSERT(client != NULL);
+   ASSERT(event != NULL);
+
+   if (client->midi_format < midi_format::SYSEX || len > MAX_SYSEX_LEN) {
+      print_debug("shard %d: client %d can't take a %d byte sysex\n", id,
+            client->id, len);
+      return;
+   }
+
+   // The events before the system exclusive message go out first.
+   if (buf != NULL) {
+      send_midi_msg(client);
+   }
+
+   // A long message would overrun the send window, so its fragments go out
+   // as acks make room for them.
+   pending.events = events;
+   pending.event = *event;
+   pending.data = data;
+   pending.len = len;
+   pending.offset = 0;
+   pending.first_seq = 0;
+   client->sysex_queue.push_back(pending);
+   sysex_waiting = true;
+   send_sysex(client);
+}
+
+void Shard::drain_commands() {
+   ShardCommand command;
+   while (commands.pop(command)) {
+      handle_command(command);
+   }
+}
+
+void Shard::drop_window(ShardClient& client) {
+   std::deque<SentPacket>::iterator it;
+   for (it = client.window.begin(); it != client.window.end(); ++it) {
+      if (!it->done) {
+         ++client.packets_lost;
+      }
+   }
+   client.window.clear();
+   client.sysex_queue.clear();
+   client.fec_seq_nums.clear();
+}
+
+void Shard::flush_batch() {
+   Batch_Packet *packet;
+   Packet_Header header;
+   std::unordered_map<int, ShardClient>::iterator client_it;
+
+   if (batch.size() == 0) {
+      return;
+   }
+
+   batch.flush();
+
+   // Book each message against its client so the sequence numbers that
+   // actually made it out are known.
+   for (uint32_t i = 0; i < batch.size(); ++i) {
+      packet = batch.packet(i);
+      client_it = clients.find(packet->tag);
+      if (client_it == clients.end()) {
+         continue;
+      }
+
+      decode_packet(packet->buf, packet->len, &header);
+      if (packet->result == (int)packet->len) {
+         client_it->second.last_sent_seq = header.seq_num;
+         ++client_it->second.packets_sent;
+      }
+      else {
+         ++client_it->second.packets_failed;
+         print_debug("shard %d failed to send seq_num %d to client %d\n", id,
+               header.seq_num, client_it->first);
+      }
+   }
+
+   batch.clear();
+}
+
+void Shard::handle_command(ShardCommand& command) {
+   ShardReply reply;
+   std::unordered_map<int, ShardClient>::iterator client_it;
+   std::unordered_map<int, ShardTrack>::iterator track_it;
+
+   switch (command.type) {
+      case shard::CLIENT_UPDATE:
+         client_it = clients.find(command.client);
+         if (client_it == clients.end()) {
+            ShardClient client;
+            client.id = command.client;
+            client.seq_num = 0;
+            client.last_sent_seq = 0;
+            client.packets_sent = 0;
+            client.packets_failed = 0;
+            client.messages = 0;
+            client.packets_acked = 0;
+            client.packets_resent = 0;
+            client.packets_lost = 0;
+            client.packets_recovered = 0;
+            client.parity_sent = 0;
+            client.loss_rate = 0;
+            client.fec_group = 0;
+            client.fec_len_xor = 0;
+            client.fec_deadline = 0;
+            client_it = clients.insert(std::make_pair(command.client,
+                     client)).first;
+         }
+         client_it->second.fd = command.fd;
+         client_it->second.addr = command.addr;
+         client_it->second.midi_format = command.midi_format;
+         client_it->second.send_offset = command.send_offset;
+         client_it->second.play_delay = command.play_delay;
+         client_it->second.active = command.active;
+         schedule_dirty = true;
+
+         // Nobody is listening for resends to an inactive client.
+         if (!command.active) {
+            drop_window(client_it->second);
+         }
+         break;
+
+      case shard::TRACK_ADD:
+         // Drop tracks from a song that has since been stopped.
+         if (command.song != song) {
+            break;
+         }
+         tracks[command.track].events = command.events;
+         tracks[command.track].cursor = command.cursor;
+         tracks[command.track].client = command.client;
+         schedule_dirty = true;
+         break;
+
+      case shard::TRACK_OWNER:
+         track_it = tracks.find(command.track);
+         if (track_it != tracks.end()) {
+            track_it->second.client = command.client;
+            schedule_dirty = true;
+         }
+         break;
+
+      case shard::TRACK_REVOKE:
+         // Hand the track (and wherever it is at in the song) back to the
+         // control thread so it can move to a client on another shard.
+         track_it = tracks.find(command.track);
+         if (track_it != tracks.end()) {
+            reply.type = shard::TRACK_RETURN;
+            reply.song = song;
+            reply.track = command.track;
+            reply.events = track_it->second.events;
+            reply.cursor = track_it->second.cursor;
+            tracks.erase(track_it);
+            post_reply(reply);
+            schedule_dirty = true;
+         }
+         break;
+
+      case shard::SONG_START:
+         // Tracks are scheduled relative to the start of their song.
+         if (command.song == song) {
+            song_start = command.start;
+            schedule_dirty = true;
+         }
+         break;
+
+      case shard::SONG_STOP:
+         tracks.clear();
+         song = command.song;
+         schedule_dirty = true;
+
+         // The old song's messages aren't worth resending.
+         for (client_it = clients.begin(); client_it != clients.end();
+               ++client_it) {
+            drop_window(client_it->second);
+         }
+         break;
+
+      case shard::PACKET_ACK:
+         ack_packet(command.client, command.seq_num, command.recovered);
+         break;
+
+      case shard::PRINT_STATS:
+         print_stats();
+         break;
+
+      default:
+         fprintf(stderr, "Shard::handle_command fell through!\n");
+         ASSERT(FALSE);
+         break;
+   }
+}
+
+bool Shard::next_deadline(nsec_t *deadline) {
+   bool found;
+   ASSERT(deadline != NULL);
+
+   drain_commands();
+   if (schedule_dirty) {
+      rebuild_schedule();
+   }
+
+   found = false;
+   if (!scheduler.empty()) {
+      *deadline = scheduler.top().deadline - coalesce_window;
+      found = true;
+   }
+   if (next_resend >= 0 && (!found || next_resend < *deadline)) {
+      *deadline = next_resend;
+      found = true;
+   }
+   if (next_parity >= 0 && (!found || next_parity < *deadline)) {
+      *deadline = next_parity;
+      found = true;
+   }
+   if (sysex_ready) {
+      *deadline = service_time;
+      found = true;
+   }
+   return found;
+}
+
+bool Shard::pop_reply(ShardReply& reply) {
+   return replies.pop(reply);
+}
+
+void Shard::post_command(ShardCommand& command) {
+   while (!commands.push(command)) {
+      // An inline shard is drained by this very thread, so make room
+      // ourselves rather than waiting on nobody.
+      if (!worker.joinable()) {
+         drain_commands();
+      }
+      else {
+         sched_yield();
+      }
+   }
+}
+
+void Shard::post_reply(ShardReply& reply) {
+   while (!replies.push(reply)) {
+      sched_yield();
+   }
+
+   // Wake the control thread up so it picks the reply up promptly.
+   if (notify_fd >= 0) {
+      uint8_t poke = 0;
+      if (write(notify_fd, &poke, sizeof(poke)) < 0) {
+         EXCEPT(errno == EAGAIN || errno == EWOULDBLOCK, {});
+      }
+   }
+}
+
+void Shard::print_stats() {
+   std::unordered_map<int, ShardClient>::iterator it;
+   ShardClient *client;
+
+   for (it = clients.begin(); it != clients.end(); ++it) {
+      client = &(it->second);
+      fprintf(stderr, "client %d: %u messages, %u acked, %u resent, %u lost "
+            "(%.2f%%), %u recovered from %u parity, loss rate %.2f%%, parity "
+            "every %u\n", client->id, client->messages, client->packets_acked,
+            client->packets_resent, client->packets_lost, client->messages ?
+            100.0 * client->packets_lost / client->messages : 0.0,
+            client->packets_recovered, client->parity_sent,
+            100.0 * client->loss_rate, client->fec_group);
+   }
+}
+
+void Shard::rebuild_schedule() {
+   std::unordered_map<int, ShardTrack>::iterator track_it;
+   std::unordered_map<int, ShardClient>::iterator client_it;
+
+   scheduler.clear();
+
+   // Only active clients get sent events, so only their tracks get scheduled.
+   for (track_it = tracks.begin(); track_it != tracks.end(); ++track_it) {
+      client_it = clients.find(track_it->second.client);
+      if (client_it == clients.end() || !client_it->second.active ||
+            track_it->second.cursor >= track_it->second.events->size()) {
+         continue;
+      }
+
+      scheduler.push(send_deadline(
+               (*track_it->second.events)[track_it->second.cursor],
+               client_it->second), track_it->first, client_it->first);
+   }
+
+   schedule_dirty = false;
+}
+
+void Shard::run() {
+   nsec_t deadline;
+   nsec_t sleep_us;
+
+   while (running.load()) {
+      service(clock_now());
+
+      // Sleep until the next track is due, but wake up regularly to pick up
+      // new commands from the control thread.
+      sleep_us = SHARD_MAX_SLEEP_US;
+      if (next_deadline(&deadline)) {
+         sleep_us = std::min(std::max((deadline - clock_now()) /
+                  NSEC_PER_USEC, (nsec_t)0), (nsec_t)SHARD_MAX_SLEEP_US);
+      }
+
+      if (sleep_us > 0) {
+         usleep(sleep_us);
+      }
+   }
+}
+
+void Shard::record_loss(ShardClient& client, bool lost) {
+   uint32_t group = client.fec_group;
+
+   client.loss_rate = (1 - LOSS_GAIN) * client.loss_rate +
+      (lost ? LOSS_GAIN : 0);
+   if (!fec) {
+      return;
+   }
+
+   // A parity message rebuilds at most one message of its group, so the
+   // groups are kept small enough that a group rarely loses two.
+   if (client.loss_rate >= FEC_MIN_LOSS) {
+      group = (uint32_t)std::min(std::max(0.5 / client.loss_rate - 1, 2.0),
+            (double)MAX_FEC_GROUP);
+   }
+   else if (client.loss_rate < FEC_MIN_LOSS / 2) {
+      group = 0;
+   }
+
+   if (group != client.fec_group) {
+      print_debug("shard %d sending client %d parity every %u messages\n",
+            id, client.id, group);
+      send_parity(client);
+      client.fec_group = group;
+   }
+}
+
+void Shard::remember_packet(ShardClient *client, uint32_t len) {
+   SentPacket packet;
+   std::deque<SentPacket>::iterator it;
+
+   packet.seq_num = client->seq_num;
+   packet.done = false;
+   packet.resends = 0;
+   packet.resend_time = service_time + resend_timeout(*client);
+   packet.last_play = msg_last_play;
+   packet.note_off = msg_note_off;
+   packet.sysex = msg_sysex;
+   packet.data.assign(buf, buf + len);
+   client->window.push_back(packet);
+   ++client->messages;
+
+   // Fold the message into parity before anything below can send parity,
+   // which may flush the batch and reuse the slot the message was built in.
+   // System exclusive fragments are resent until they get through instead,
+   // and a full sized one would make the parity too big for one datagram.
+   if (client->fec_group > 0 && !msg_sysex) {
+      add_to_parity(client, client->window.back().data);
+   }
+
+   // Make room by giving up on the oldest message, but never on a system
+   // exclusive fragment (those only go out when there is room).
+   if (client->window.size() > SEND_WINDOW_SIZE) {
+      for (it = client->window.begin(); it != client->window.end() &&
+            it->sysex && !it->done; ++it) {}
+      if (it != client->window.end()) {
+         if (!it->done) {
+            ++client->packets_lost;
+            record_loss(*client, true);
+         }
+         client->window.erase(it);
+      }
+   }
+
+   if (next_resend < 0 || packet.resend_time < next_resend) {
+      next_resend = packet.resend_time;
+   }
+}
+
+void Shard::resend_packets(nsec_t now) {
+   std::unordered_map<int, ShardClient>::iterator client_it;
+   std::deque<SentPacket>::iterator it;
+   ShardClient *client;
+   nsec_t delay;
+   uint8_t *out;
+
+   if (next_resend < 0 || now < next_resend) {
+      return;
+   }
+
+   next_resend = -1;
+   for (client_it = clients.begin(); client_it != clients.end();
+         ++client_it) {
+      client = &(client_it->second);
+
+      // The client's one way delay.
+      delay = client->play_delay - client->send_offset;
+
+      for (it = client->window.begin(); it != client->window.end(); ++it) {
+         if (it->done) {
+            continue;
+         }
+
+         if (it->resend_time <= now) {
+            // A message that would arrive after its events play is only
+            // worth it to stop a stuck note. System exclusive messages
+            // (patches and the like) have to get there no matter what.
+            if (!it->sysex && (it->resends >= MAX_RESENDS ||
+                     (now + delay > it->last_play && !it->note_off))) {
+               it->done = true;
+               ++client->packets_lost;
+               record_loss(*client, true);
+               continue;
+            }
+
+            if (batch.full()) {
+               flush_batch();
+            }
+            out = batch.stage(client->fd, &client->addr, client->id);
+            memcpy(out, it->data.data(), it->data.size());
+            batch.commit(it->data.size());
+
+            ++it->resends;
+            ++client->packets_resent;
+            it->resend_time = now + resend_timeout(*client);
+            print_debug("shard %d resending seq_num %d to client %d\n", id,
+                  it->seq_num, client->id);
+         }
+
+         if (next_resend < 0 || it->resend_time < next_resend) {
+            next_resend = it->resend_time;
+         }
+      }
+
+      while (!client->window.empty() && client->window.front().done) {
+         client->window.pop_front();
+      }
+   }
+}
+
+nsec_t Shard::resend_timeout(ShardClient& client) {
+   // One and a half round trips, so ordinary jitter doesn't cause a resend.
+   return std::max(3 * (client.play_delay - client.send_offset),
+         msec_to_nsec(MIN_RESEND_MS));
+}
+
+nsec_t Shard::send_deadline(const MyPmEvent& event, ShardClient& client) {
+   return song_start + msec_to_nsec(event.timestamp) + client.send_offset -
+      lookahead;
+}
+
+void Shard::send_midi_msg(ShardClient *client) {
+   ASSERT(client != NULL);
+   ASSERT(msg_header.header.flag == flag::MIDI ||
+         msg_header.header.flag == flag::MIDI_TIMED ||
+         msg_header.header.flag == flag::MIDI_SYSEX);
+
+   // The header goes in last, once the number of events is known (system
+   // exclusive fragments came with theirs).
+   if (msg_header.header.flag == flag::MIDI) {
+      encode_packet(msg_header.header, buf, buf_offset);
+   }
+   else if (msg_header.header.flag == flag::MIDI_TIMED) {
+      encode_packet(msg_header, buf, buf_offset);
+   }
+
+   // Leave the packet in the batch, it goes out with the rest of this round,
+   // and hang on to it in case it needs to be resent.
+   batch.commit(buf_offset);
+   remember_packet(client, buf_offset);
+
+   // Reset the offset into the buffer for the next message to build on.
+   buf = NULL;
+   buf_offset = 0;
+
+   // Increment the seq_num so we know what the next packet should go out with
+   client->seq_num += 2;
+   print_debug("shard %d setting client %d seq_num to %d\n", id, client->id,
+         client->seq_num);
+}
+
+void Shard::send_overdue_parity(nsec_t now) {
+   std::unordered_map<int, ShardClient>::iterator it;
+
+   if (next_parity < 0 || now < next_parity) {
+      return;
+   }
+
+   next_parity = -1;
+   for (it = clients.begin(); it != clients.end(); ++it) {
+      if (it->second.fec_seq_nums.empty()) {
+         continue;
+      }
+
+      if (it->second.fec_deadline <= now) {
+         send_parity(it->second);
+      }
+      else if (next_parity < 0 || it->second.fec_deadline < next_parity) {
+         next_parity = it->second.fec_deadline;
+      }
+   }
+}
+
+void Shard::send_parity(ShardClient& client) {
+   Parity_Header parity;
+   uint8_t *out;
+
+   if (client.fec_seq_nums.empty()) {
+      return;
+   }
+
+   if (batch.full()) {
+      flush_batch();
+   }
+   out = batch.stage(client.fd, &client.addr, client.id);
+   memset(&parity, '\0', sizeof(Parity_Header));
+   parity.header.seq_num = client.fec_seq_nums.back();
+   parity.header.flag = flag::MIDI_PARITY;
+   parity.num_packets = client.fec_seq_nums.size();
+   parity.len_xor = client.fec_len_xor;
+   for (uint32_t i = 0; i < client.fec_seq_nums.size(); ++i) {
+      parity.seq_nums[i] = client.fec_seq_nums[i];
+   }
+   encode_packet(parity, out, MAX_BUF_SIZE);
+   memcpy(out + sizeof(Parity_Header), client.fec_parity.data(),
+         client.fec_parity.size());
+   batch.commit(sizeof(Parity_Header) + client.fec_parity.size());
+
+   ++client.parity_sent;
+   client.fec_seq_nums.clear();
+}
+
+void Shard::send_sysex(ShardClient *client) {
+   Sysex_Header sysex_header;
+   PendingSysex *pending;
+   uint32_t fragment;
+
+   ASSERT(client != NULL);
+   ASSERT(buf == NULL);
+
+   while (!client->sysex_queue.empty() &&
+         client->window.size() < SEND_WINDOW_SIZE) {
+      pending = &(client->sysex_queue.front());
+      if (pending->offset == 0) {
+         pending->first_seq = client->seq_num;
+      }
+      fragment = std::min(pending->len - pending->offset,
+            (uint32_t)MAX_SYSEX_FRAGMENT);
+
+      // Each fragment is copied straight from the song into the batch.
+      if (batch.full()) {
+         flush_batch();
+      }
+      buf = batch.stage(client->fd, &client->addr, client->id);
+      sysex_header.header.seq_num = client->seq_num;
+      sysex_header.header.flag = flag::MIDI_SYSEX;
+      sysex_header.header.num_midi_events = 0;
+      sysex_header.first_seq = pending->first_seq;
+      sysex_header.total_len = pending->len;
+      sysex_header.offset = pending->offset;
+      sysex_header.base_time = song_start + client->play_delay;
+      sysex_header.timestamp = pending->event.timestamp;
+      sysex_header.timed = lookahead > 0;
+      encode_packet(sysex_header, buf, MAX_BUF_SIZE);
+      msg_header.header = sysex_header.header;
+      memcpy(buf + sizeof(Sysex_Header), pending->data + pending->offset,
+            fragment);
+      buf_offset = sizeof(Sysex_Header) + fragment;
+
+      msg_last_play = song_start + msec_to_nsec(pending->event.timestamp) +
+         client->play_delay;
+      msg_note_off = false;
+      msg_sysex = true;
+      send_midi_msg(client);
+
+      pending->offset += fragment;
+      if (pending->offset >= pending->len) {
+         client->sysex_queue.pop_front();
+      }
+   }
+}
+
+void Shard::service(nsec_t now) {
+   ShardReply reply;
+   ShardClient *client;
+   ShardTrack *track;
+   const TrackEvents *events;
+   const uint8_t *sysex;
+   uint32_t sysex_len;
+   std::vector<ScheduledTrack>::iterator due_it;
+   std::unordered_map<int, ShardTrack>::iterator track_it;
+   std::unordered_map<int, ShardClient>::iterator client_it;
+   nsec_t horizon = now + coalesce_window;
+
+   service_time = now;
+   drain_commands();
+
+   if (schedule_dirty) {
+      rebuild_schedule();
+   }
+
+   // Only service the tracks whose next event is due, the rest stay parked in
+   // the scheduler until their deadline comes around.
+   due.clear();
+   while (!scheduler.empty() && scheduler.top().deadline <= horizon) {
+      due.push_back(scheduler.top());
+      scheduler.pop();
+   }
+
+   // Line the due tracks up by client (keeping them in deadline order) so
+   // every client's events share packets no matter which track they are on.
+   std::stable_sort(due.begin(), due.end(), lower_client);
+
+   client = NULL;
+   for (due_it = due.begin(); due_it != due.end(); ++due_it) {
+      // Finish the previous client's message before moving on to the next
+      // client.
+      if (client != NULL && client->id != due_it->client && buf != NULL) {
+         send_midi_msg(client);
+      }
+
+      // Get the client playing the track and the track's events.
+      track_it = tracks.find(due_it->track);
+      client = &(clients[due_it->client]);
+      track = &(track_it->second);
+      events = track->events.get();
+
+      print_debug("shard %d: client %d track %d\n", id, client->id,
+            due_it->track);
+
+      // Add every event from this track that is due to the client's message
+      while (track->cursor < events->size() &&
+            send_deadline((*events)[track->cursor], *client) <= horizon) {
+         // Add this event to the buffered midi message, system exclusive
+         // events get messages of their own.
+         sysex = events->sysex(track->cursor, &sysex_len);
+         if (sysex != NULL) {
+            append_sysex(client, track->events, &(*events)[track->cursor],
+                  sysex, sysex_len);
+         }
+         else {
+            append_to_buf(client, &(*events)[track->cursor]);
+         }
+
+         // Move on to the track's next event
+         ++track->cursor;
+      }
+
+      // Park the track until its next event is due, or let the control
+      // thread know that the track is finished.
+      if (track->cursor < events->size()) {
+         scheduler.push(send_deadline((*events)[track->cursor], *client),
+               due_it->track, due_it->client);
+      }
+      else {
+         reply.type = shard::TRACK_DONE;
+         reply.song = song;
+         reply.track = due_it->track;
+         reply.events.reset();
+         reply.cursor = 0;
+         tracks.erase(track_it);
+         post_reply(reply);
+      }
+   }
+
+   // Send the last client's midi message
+   if (client != NULL && buf != NULL) {
+      send_midi_msg(client);
+   }
+
+   // Resend whatever went unacked for too long, and send the parity of the
+   // groups that didn't fill up in time.
+   resend_packets(now);
+   send_overdue_parity(now);
+
+   // Send the system exclusive fragments that acks made room for.
+   if (sysex_waiting) {
+      sysex_waiting = false;
+      for (client_it = clients.begin(); client_it != clients.end();
+            ++client_it) {
+         send_sysex(&(client_it->second));
+         if (!client_it->second.sysex_queue.empty()) {
+            sysex_waiting = true;
+         }
+      }
+   }
+   sysex_ready = false;
+
+   // Everything due this round goes out together.
+   flush_batch();
+}
+
+void Shard::setup_midi_msg(ShardClient *client) {
+   ASSERT(client != NULL);
+
+   if (batch.full()) {
+      flush_batch();
+   }
+
+   buf = batch.stage(client->fd, &client->addr, client->id);
+   msg_header.header.seq_num = client->seq_num;
+   msg_header.header.num_midi_events = 0;
+   msg_last_play = 0;
+   msg_note_off = false;
+   msg_sysex = false;
+   encoder.reset(client->midi_format);
+
+   if (lookahead == 0) {
+      msg_header.header.flag = flag::MIDI;
+      buf_offset = sizeof(Packet_Header);
+      return;
+   }
+
+   // Events sent ahead of time carry when to play them in the server's
+   // clock, which is when the song started plus the slowest client's delay
+   // (the same moment the event would play at if it was sent just in time).
+   msg_header.header.flag = flag::MIDI_TIMED;
+   msg_header.base_time = song_start + client->play_delay;
+   buf_offset = sizeof(Timed_Midi_Header);
+}
+
+void Shard::start() {
+   ASSERT(!worker.joinable());
+   running.store(true);
+   worker = std::thread(&Shard::run, this);
+}
+
+void Shard::stop() {
+   if (worker.joinable()) {
+      running.store(false);
+      worker.join();
+   }
+}
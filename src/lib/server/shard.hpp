@@ -0,0 +1,347 @@
+#ifndef __SHARD__HPP__
+#define __SHARD__HPP__
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "network/midi_codec.hpp"
+#include "network/network.hpp"
+#include "server/scheduler.hpp"
+#include "server/song.hpp"
+#include "server/spsc_queue.hpp"
+
+#define SHARD_QUEUE_SIZE   1024  // Slots in each shard's command/reply queue.
+
+#define SHARD_MAX_SLEEP_US 1000  // Longest a shard thread sleeps before it
+                                 // checks for new commands.
+
+#define DEFAULT_SEND_BATCH 32    // Midi messages a shard sends per syscall.
+
+#define MAX_COALESCE_WINDOW 10   // Longest coalescing window in milliseconds.
+
+#define MAX_LOOKAHEAD 5000       // Longest lookahead in milliseconds.
+
+#define SEND_WINDOW_SIZE 256     // Most unacked midi messages kept per client
+                                 // for resending (system exclusive fragments
+                                 // are only sent while there is room).
+
+#define MIN_RESEND_MS 20         // Shortest wait (ms) for an ack before a midi
+                                 // message is resent.
+
+#define MAX_RESENDS 3            // Times a midi message is resent before it is
+                                 // given up on.
+
+#define LOSS_GAIN 0.0625         // Weight of each message's fate in a client's
+                                 // loss rate.
+
+#define FEC_MIN_LOSS 0.01        // Loss rate that turns parity on for a client
+                                 // (it goes off below half of this).
+
+#define FEC_MAX_WAIT_MS 20       // Longest (ms) a parity group waits to fill
+                                 // up before its parity is sent anyway.
+
+#define MAX_SYSEX_FRAGMENT (MAX_MIDI_PACKET - sizeof(Sysex_Header))
+                                 // Most bytes of a system exclusive message
+                                 // sent in one MIDI_SYSEX message.
+
+namespace shard {
+   // Commands the control thread sends to a shard.
+   enum Command_Type { CLIENT_UPDATE, TRACK_ADD, TRACK_OWNER, TRACK_REVOKE,
+      SONG_START, SONG_STOP, PACKET_ACK, PRINT_STATS };
+
+   // Replies a shard sends back to the control thread.
+   enum Reply_Type { TRACK_DONE, TRACK_RETURN };
+};
+
+typedef struct ShardCommand {
+   shard::Command_Type type;
+   uint32_t song;                   // Song the command belongs to.
+   int client;                      // Client id the command is about.
+   int fd;                          // CLIENT_UPDATE: client's socket fd.
+   sockaddr_in addr;                // CLIENT_UPDATE: client's address.
+   uint8_t midi_format;             // CLIENT_UPDATE: client's midi format.
+   nsec_t send_offset;              // CLIENT_UPDATE: max_delay - avg_delay.
+   nsec_t play_delay;               // CLIENT_UPDATE: max_delay.
+   bool active;                     // CLIENT_UPDATE: is the client alive.
+   int track;                       // TRACK_*: track the command is about.
+   std::shared_ptr<const TrackEvents> events;   // TRACK_ADD: track's events.
+   uint32_t cursor;                 // TRACK_ADD: index of the next event.
+   nsec_t start;                    // SONG_START: when the song started.
+   uint32_t seq_num;                // PACKET_ACK: seq_num the client acked.
+   bool recovered;                  // PACKET_ACK: the client rebuilt the
+                                    // message from parity.
+} ShardCommand;
+
+typedef struct ShardReply {
+   shard::Reply_Type type;
+   uint32_t song;                   // Song the reply belongs to.
+   int track;                       // Track the reply is about.
+   std::shared_ptr<const TrackEvents> events;   // TRACK_RETURN: track's events.
+   uint32_t cursor;                 // TRACK_RETURN: index of the next event.
+} ShardReply;
+
+// A midi message sent to a client that may need to be sent again.
+typedef struct SentPacket {
+   uint32_t seq_num;       // Sequence number of the message.
+   bool done;              // True once acked or given up on.
+   uint32_t resends;       // Times the message has been resent.
+   nsec_t resend_time;     // When to resend it if it isn't acked by then.
+   nsec_t last_play;       // When (server's clock) its last event plays.
+   bool note_off;          // True if it carries a note off, which is worth
+                           // resending even late rather than leaving a
+                           // note stuck on.
+   bool sysex;             // True if it is a system exclusive fragment,
+                           // which is resent for as long as it takes and
+                           // never dropped to make room in the window.
+   std::vector<uint8_t> data; // The message itself.
+} SentPacket;
+
+// A system exclusive message whose fragments are waiting for room in a
+// client's send window.
+typedef struct PendingSysex {
+   std::shared_ptr<const TrackEvents> events;   // Track the message is in,
+                                                // which keeps data alive.
+   MyPmEvent event;        // The event the message plays at.
+   const uint8_t *data;    // The message itself.
+   uint32_t len;           // Length of the message.
+   uint32_t offset;        // Bytes of it sent so far.
+   uint32_t first_seq;     // seq_num of the message with the first fragment.
+} PendingSysex;
+
+// What a shard needs to know about a client to send it midi messages.
+typedef struct ShardClient {
+   int id;                 // Client id assigned by the server.
+   int fd;                 // Client's socket fd.
+   sockaddr_in addr;       // Client's socket address information.
+   uint8_t midi_format;    // Wire format of the client's midi events.
+   uint32_t seq_num;       // Sequence number of the next midi message.
+   uint32_t last_sent_seq; // Sequence number of the last message sent.
+   uint32_t packets_sent;  // Number of midi messages sent in full.
+   uint32_t packets_failed;// Number of midi messages the kernel refused.
+   uint32_t messages;      // Number of distinct midi messages built.
+   uint32_t packets_acked; // Number of midi messages the client acked.
+   uint32_t packets_resent;// Number of times midi messages were resent.
+   uint32_t packets_lost;  // Number of midi messages given up on unacked.
+   uint32_t packets_recovered; // Number of midi messages rebuilt from parity.
+   uint32_t parity_sent;   // Number of parity messages sent.
+   double loss_rate;       // Share of midi messages that recently needed a
+                           // resend or parity to get through.
+   uint32_t fec_group;     // Midi messages per parity message (0 if off).
+   std::vector<uint32_t> fec_seq_nums; // Messages in the open parity group.
+   std::vector<uint8_t> fec_parity;    // XOR of the messages in the group.
+   uint16_t fec_len_xor;   // XOR of the lengths of the messages in the group.
+   nsec_t fec_deadline;    // When the open group's parity goes out anyway.
+   std::deque<SentPacket> window; // Messages sent but not yet done with, in
+                                  // seq_num order.
+   std::deque<PendingSysex> sysex_queue; // System exclusive messages still
+                                         // to be sent, oldest first.
+   nsec_t send_offset;     // How far after an event's timestamp to send it.
+   nsec_t play_delay;      // How far after an event's timestamp it plays.
+   bool active;            // Only active clients are sent events.
+} ShardClient;
+
+// A track the shard is currently responsible for sending.
+typedef struct ShardTrack {
+   std::shared_ptr<const TrackEvents> events;   // The track's events.
+   uint32_t cursor;                 // Index of the next event to send.
+   int client;                      // Id of the client that plays the track.
+} ShardTrack;
+
+// A slice of the server's clients along with the tracks they play. Each shard
+// has its own send buffer and scheduler so shards never contend with each
+// other. The control thread talks to a shard only through its lock-free
+// command and reply queues, which lets the shard either run on its own
+// thread or be serviced inline by the control thread.
+class Shard {
+   private:
+      int id;                       // Index of this shard.
+      int notify_fd;                // Poked when a reply is posted (or -1).
+      std::atomic<bool> running;    // Keeps the shard thread alive.
+      std::thread worker;           // Thread servicing the shard (if any).
+
+      SendBatch batch;              // Midi messages waiting to be sent.
+      uint8_t *buf;                 // Batch buffer of the message being built.
+      uint64_t buf_offset;          // Offset to index into the buffer with.
+      Timed_Midi_Header msg_header; // Header of the message being built,
+                                    // written into buf once it is done.
+      MidiEncoder encoder;          // Writes the message's events.
+      nsec_t msg_last_play;         // When the message's last event plays.
+      bool msg_note_off;            // True if the message has a note off.
+      bool msg_sysex;               // True if the message is a system
+                                    // exclusive fragment.
+
+      uint32_t song;                // Song the shard is currently playing.
+      nsec_t song_start;            // When the song started (event
+                                    // timestamps count from here).
+      bool schedule_dirty;          // True if the scheduler needs a rebuild.
+      TrackScheduler scheduler;     // Tracks ordered by their next deadline.
+      nsec_t coalesce_window;       // How early an event may be sent to share
+                                    // a packet with the events due now.
+      nsec_t lookahead;             // How far ahead events are sent as
+                                    // MIDI_TIMED messages (0 sends them just
+                                    // in time as MIDI messages).
+      std::vector<ScheduledTrack> due; // Tracks being serviced this round.
+      nsec_t service_time;          // now of the service() round underway.
+      nsec_t next_resend;           // Earliest resend_time of any unacked
+                                    // message (-1 if there are none).
+      bool fec;                     // True if clients losing messages get
+                                    // parity messages.
+      uint32_t max_msg_len;         // Longest midi message built, which
+                                    // leaves room for a parity header so
+                                    // parity fits in one datagram too.
+      bool sysex_waiting;           // True if some client has system
+                                    // exclusive fragments left to send.
+      bool sysex_ready;             // True if an ack made room for some of
+                                    // them.
+      nsec_t next_parity;           // Earliest fec_deadline of any open parity
+                                    // group (-1 if there are none).
+
+      // Clients owned by this shard keyed by client id.
+      std::unordered_map<int, ShardClient> clients;
+
+      // Tracks owned by this shard keyed by track number.
+      std::unordered_map<int, ShardTrack> tracks;
+
+      // Commands from the control thread.
+      SpscQueue<ShardCommand, SHARD_QUEUE_SIZE> commands;
+
+      // Replies to the control thread.
+      SpscQueue<ShardReply, SHARD_QUEUE_SIZE> replies;
+
+      // Marks the client's message with seq_num as acked, having been
+      // rebuilt from parity if recovered.
+      void ack_packet(int client_id, uint32_t seq_num, bool recovered);
+
+      // Adds the midi message that was just committed to the batch (the copy
+      // kept in the client's send window) to the client's open parity group,
+      // sending the parity once the group is full.
+      void add_to_parity(ShardClient *client,
+            const std::vector<uint8_t>& data);
+
+      // Appends the event to the client's midi message, incrementing the
+      // number of midi events in msg_header. A new message is started if
+      // there is none yet or the current one is full.
+      void append_to_buf(ShardClient *client, const MyPmEvent *event);
+
+      // Queues the len bytes of the system exclusive event (which are in
+      // events) to go out in MIDI_SYSEX messages of their own, after
+      // whatever the client's message holds so far, and sends as many of
+      // them as the client's send window has room for. Clients that can't
+      // take them go without.
+      void append_sysex(ShardClient *client,
+            const std::shared_ptr<const TrackEvents>& events,
+            const MyPmEvent *event, const uint8_t *data, uint32_t len);
+
+      // Gives up on every message the client hasn't acked and every system
+      // exclusive message it hasn't been sent, ie. once the client went
+      // inactive.
+      void drop_window(ShardClient& client);
+
+      // Sends every midi message in the batch and books the outcome of each
+      // one against its client.
+      void flush_batch();
+
+      // Applies a single command from the control thread.
+      void handle_command(ShardCommand& command);
+
+      // Hands a reply to the control thread and wakes it up.
+      void post_reply(ShardReply& reply);
+
+      // Prints how many of each client's midi messages were acked, resent
+      // and lost.
+      void print_stats();
+
+      // Reschedules every track of every active client from scratch.
+      void rebuild_schedule();
+
+      // Folds whether a message to the client got through on its own (lost
+      // is false) into the client's loss rate, and sizes its parity groups
+      // to match.
+      void record_loss(ShardClient& client, bool lost);
+
+      // Adds the midi message that was just committed to the batch to the
+      // client's send window.
+      void remember_packet(ShardClient *client, uint32_t len);
+
+      // Resends the unacked messages whose acks are overdue, as long as they
+      // can still arrive before they play (or carry a note off). The rest
+      // are given up on.
+      void resend_packets(nsec_t now);
+
+      // Returns how long to wait on the client's ack before resending.
+      nsec_t resend_timeout(ShardClient& client);
+
+      // Sends the parity of the client's open parity group, if it has one.
+      void send_parity(ShardClient& client);
+
+      // Sends the client's queued system exclusive fragments while its send
+      // window has room for them. The client's message must be finished.
+      void send_sysex(ShardClient *client);
+
+      // Sends the parity of every group that has waited too long to fill up.
+      void send_overdue_parity(nsec_t now);
+
+      // Main loop of the shard's thread.
+      void run();
+
+      // Returns the time at which the event should be sent to the client so
+      // that it plays in step with the slowest client.
+      nsec_t send_deadline(const MyPmEvent& event, ShardClient& client);
+
+      // Finishes the midi message in the buffer and leaves it in the batch
+      // to be sent with the rest of the messages due this round.
+      void send_midi_msg(ShardClient *client);
+
+      // Stages a new midi message to the specified client in the batch,
+      // flushing the batch first if it is full.
+      void setup_midi_msg(ShardClient *client);
+
+   public:
+      // Creates shard number id which sends up to batch_size midi messages
+      // per syscall, coalescing the events due within coalesce_window ms of
+      // each other for a client into the same packets. With a lookahead
+      // events go out that many ms early carrying the time to play them at.
+      // With fec, clients that lose messages are also sent parity messages
+      // to rebuild them from. If notify_fd isn't -1 a byte is written to it
+      // every time a reply is posted.
+      Shard(int id, int notify_fd, uint32_t batch_size, long coalesce_window,
+            long lookahead, bool fec);
+
+      ~Shard();
+
+      // Applies every pending command from the control thread.
+      void drain_commands();
+
+      // Sets deadline to the clock_now() time the next track is due (less
+      // the coalescing window) or a message needs resending (or its parity
+      // sent), or to right away if acks made room for system exclusive
+      // fragments, returning false if the shard has nothing scheduled. Only
+      // safe for inline shards.
+      bool next_deadline(nsec_t *deadline);
+
+      // Pops a reply for the control thread, returning false if there are
+      // none.
+      bool pop_reply(ShardReply& reply);
+
+      // Queues a command for the shard (control thread only).
+      void post_command(ShardCommand& command);
+
+      // Applies pending commands and sends every event that is due at now, a
+      // clock_now() time (or within the coalescing window of it). Each client
+      // gets its events from all of its tracks in as few packets as possible
+      // and all of the resulting midi messages are batched together, along
+      // with whatever unacked messages are due to be resent.
+      void service(nsec_t now);
+
+      // Starts a thread that services the shard against the monotonic clock.
+      void start();
+
+      // Stops and joins the shard's thread.
+      void stop();
+};
+
+#endif
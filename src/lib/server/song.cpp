@@ -0,0 +1,127 @@
+#include <stdlib.h>           // posix_memalign, free
+#include <algorithm>
+#include "server/song.hpp"
+
+// Orders system exclusive events by their index in the track.
+static bool lower_index(const SysexRef& ref, uint32_t index) {
+   return ref.index < index;
+}
+
+TrackEvents::TrackEvents(MidiFile& midifile, int track) {
+   MidiEvent *midi_event;
+   MyPmEvent *event;
+   std::vector<double> seconds;
+   uint32_t num_events = midifile[track].size();
+   bool sysex_open = false;
+   SysexRef ref;
+
+   count = 0;
+   events = NULL;
+
+   // Convert every tick in the track to seconds in a single pass over the
+   // track and the tempo map.
+   midifile.getTrackTimesInSeconds(track, seconds);
+
+   // Line the array up with the cache so a shard walking it never drags in
+   // a line it doesn't need.
+   if (num_events > 0) {
+      ASSERT(posix_memalign((void **)&events, CACHE_LINE_SIZE,
+               num_events * sizeof(MyPmEvent)) == 0);
+   }
+
+   for (uint32_t i = 0; i < num_events; ++i) {
+      midi_event = &midifile[track][i];
+      if (midi_event->size() == 0 || midi_event->isMeta()) {
+         continue;
+      }
+
+      // A system exclusive message split up in the file goes on in 0xF7
+      // events holding the raw bytes that follow, up to the closing 0xF7.
+      if ((*midi_event)[0] == 0xF7) {
+         if (sysex_open) {
+            sysex_data.insert(sysex_data.end(), midi_event->begin() + 1,
+                  midi_event->end());
+            sysex_refs.back().len += midi_event->size() - 1;
+            sysex_open = sysex_data.back() != 0xF7;
+         }
+         continue;
+      }
+
+      event = &events[count];
+      if ((*midi_event)[0] == 0xF0) {
+         if (sysex_open) {
+            sysex_data.push_back(0xF7);
+            ++sysex_refs.back().len;
+         }
+
+         ref.index = count;
+         ref.offset = sysex_data.size();
+         ref.len = midi_event->size();
+         sysex_refs.push_back(ref);
+         sysex_data.insert(sysex_data.end(), midi_event->begin(),
+               midi_event->end());
+         sysex_open = sysex_data.back() != 0xF7;
+      }
+
+      // Making a port midi message based off of the bytes from the
+      // midi_event
+      event->message[0] = (*midi_event)[0];
+      event->message[1] = midi_event->size() > 1 ? (*midi_event)[1] : 0;
+      event->message[2] = midi_event->size() > 2 ? (*midi_event)[2] : 0;
+
+      // The timestamp to play the event at in milliseconds.
+      event->timestamp = seconds[i] * 1000.0;
+      ++count;
+   }
+
+   // Close off a system exclusive message the file never finished.
+   if (sysex_open) {
+      sysex_data.push_back(0xF7);
+      ++sysex_refs.back().len;
+   }
+}
+
+TrackEvents::~TrackEvents() {
+   free(events);
+}
+
+uint64_t TrackEvents::bytes() const {
+   return sizeof(TrackEvents) + count * sizeof(MyPmEvent) +
+      sysex_data.size() + sysex_refs.size() * sizeof(SysexRef);
+}
+
+const uint8_t *TrackEvents::find_sysex(uint32_t index, uint32_t *len) const {
+   std::vector<SysexRef>::const_iterator it;
+
+   it = std::lower_bound(sysex_refs.begin(), sysex_refs.end(), index,
+         lower_index);
+   if (it == sysex_refs.end() || it->index != index) {
+      return NULL;
+   }
+
+   *len = it->len;
+   return sysex_data.data() + it->offset;
+}
+
+Song::Song(MidiFile& midifile) {
+   num_bytes = sizeof(Song);
+   for (int track = 0; track < midifile.getTrackCount(); ++track) {
+      tracks.push_back(std::make_shared<const TrackEvents>(midifile, track));
+      num_bytes += tracks.back()->bytes();
+   }
+}
+
+Song::~Song() {
+}
+
+uint64_t Song::bytes() {
+   return num_bytes;
+}
+
+int Song::num_tracks() {
+   return tracks.size();
+}
+
+std::shared_ptr<const TrackEvents> Song::track(int index) {
+   return tracks[index];
+}
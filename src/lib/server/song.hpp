@@ -0,0 +1,93 @@
+#ifndef __SONG__HPP__
+#define __SONG__HPP__
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "midifile/include/MidiFile.h"
+#include "network/network.hpp"
+
+// Where the bytes of a track's system exclusive event are kept.
+typedef struct SysexRef {
+   uint32_t index;      // Index of the event in the track.
+   uint32_t offset;     // Offset of its bytes in the track's sysex data.
+   uint32_t len;        // Number of bytes, from the 0xF0 through the 0xF7.
+} SysexRef;
+
+// A track's events compiled into one contiguous, cache aligned array. The
+// array never changes once it is built, so shards walk it with their own
+// cursor and the same array is shared by every shard and every replay of
+// the song. Meta events only matter to the file and are left out. System
+// exclusive events are in the array as a bare 0xF0 with their bytes kept on
+// the side.
+class TrackEvents {
+   private:
+      MyPmEvent *events;   // The track's events in the order they play.
+      uint32_t count;      // Number of events in the array.
+
+      // Bytes of every system exclusive event, one after the other.
+      std::vector<uint8_t> sysex_data;
+
+      // Where each system exclusive event's bytes are, by event index.
+      std::vector<SysexRef> sysex_refs;
+
+      TrackEvents(const TrackEvents& other);
+      TrackEvents& operator=(const TrackEvents& other);
+
+      // Looks up the bytes of the index'th event, which is system exclusive.
+      const uint8_t *find_sysex(uint32_t index, uint32_t *len) const;
+
+   public:
+      // Compiles the events of the specified track of the midifile.
+      TrackEvents(MidiFile& midifile, int track);
+
+      ~TrackEvents();
+
+      // Returns roughly how many bytes of memory the track takes.
+      uint64_t bytes() const;
+
+      // Returns the index'th event of the track.
+      const MyPmEvent& operator[](uint32_t index) const {
+         return events[index];
+      }
+
+      // Returns the number of events in the track.
+      uint32_t size() const {
+         return count;
+      }
+
+      // Returns the bytes of the index'th event and sets len to how many
+      // there are if it is a system exclusive event, NULL otherwise.
+      const uint8_t *sysex(uint32_t index, uint32_t *len) const {
+         if (events[index].message[0] != 0xF0) {
+            return NULL;
+         }
+         return find_sysex(index, len);
+      }
+};
+
+// Every track of a midi song compiled and ready to be handed to the shards.
+class Song {
+   private:
+      // The compiled tracks, indexed by track number.
+      std::vector<std::shared_ptr<const TrackEvents> > tracks;
+
+      uint64_t num_bytes;  // Memory taken by the compiled song.
+
+   public:
+      // Compiles every track of the midifile.
+      Song(MidiFile& midifile);
+
+      ~Song();
+
+      // Returns roughly how many bytes of memory the compiled song takes.
+      uint64_t bytes();
+
+      // Returns the number of tracks in the song.
+      int num_tracks();
+
+      // Returns the compiled events of the specified track.
+      std::shared_ptr<const TrackEvents> track(int index);
+};
+
+#endif
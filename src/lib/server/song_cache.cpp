@@ -0,0 +1,78 @@
+#include <sys/stat.h>         // stat
+#include <sstream>
+#include "network/network.hpp"
+#include "server/song_cache.hpp"
+
+SongCache::SongCache(uint64_t budget) {
+   this->budget = budget;
+   used = 0;
+}
+
+SongCache::~SongCache() {
+}
+
+void SongCache::evict() {
+   while (used > budget && !songs.empty()) {
+      print_debug("Evicting song %s from the cache\n",
+            songs.back().key.c_str());
+      used -= songs.back().song->bytes();
+      index.erase(songs.back().key);
+      songs.pop_back();
+   }
+}
+
+std::shared_ptr<Song> SongCache::find(const std::string& key) {
+   std::unordered_map<std::string, std::list<CachedSong>::iterator>::iterator
+      it = index.find(key);
+   if (it == index.end()) {
+      return std::shared_ptr<Song>();
+   }
+
+   // Move the song to the front since it was just used.
+   songs.splice(songs.begin(), songs, it->second);
+   return it->second->song;
+}
+
+void SongCache::insert(const std::string& key, std::shared_ptr<Song> song) {
+   ASSERT(song != NULL);
+
+   if (song->bytes() > budget || index.find(key) != index.end()) {
+      return;
+   }
+
+   CachedSong cached;
+   cached.key = key;
+   cached.song = song;
+   songs.push_front(cached);
+   index[key] = songs.begin();
+   used += song->bytes();
+
+   evict();
+}
+
+bool SongCache::make_key(const std::string& path, std::string *key) {
+   ASSERT(key != NULL);
+
+   struct stat file_stat;
+   if (stat(path.c_str(), &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+      return false;
+   }
+
+   std::ostringstream oss;
+   oss << path << "|" << file_stat.st_mtime << "|" << file_stat.st_size;
+   key->assign(oss.str());
+   return true;
+}
+
+void SongCache::set_budget(uint64_t budget) {
+   this->budget = budget;
+   evict();
+}
+
+uint32_t SongCache::size() {
+   return songs.size();
+}
+
+uint64_t SongCache::used_bytes() {
+   return used;
+}
@@ -0,0 +1,66 @@
+#ifndef __SONG_CACHE__HPP__
+#define __SONG_CACHE__HPP__
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "server/song.hpp"
+
+#define DEFAULT_SONG_CACHE_MB 64 // Default memory budget of the song cache.
+
+// A compiled song held by the SongCache.
+typedef struct CachedSong {
+   std::string key;              // Path, mtime and size of the song's file.
+   std::shared_ptr<Song> song;   // The compiled song.
+} CachedSong;
+
+// Least recently used cache of compiled songs, so playing a song again skips
+// parsing its midi file. Songs are keyed by their file's path, modification
+// time and size, so a song that changed on disk is compiled again. Once the
+// cached songs take up more than the memory budget the least recently played
+// ones are dropped.
+class SongCache {
+   private:
+      uint64_t budget;              // Most bytes the cached songs can take.
+      uint64_t used;                // Bytes taken by the cached songs.
+
+      // Cached songs, most recently used at the front.
+      std::list<CachedSong> songs;
+
+      // Mapping of song keys to their place in the songs list.
+      std::unordered_map<std::string, std::list<CachedSong>::iterator> index;
+
+      // Drops least recently used songs until the cache fits its budget.
+      void evict();
+
+   public:
+      // Creates a cache that holds up to budget bytes of compiled songs.
+      SongCache(uint64_t budget);
+
+      ~SongCache();
+
+      // Returns the cached song for the key (marking it as recently used), or
+      // NULL if it isn't cached.
+      std::shared_ptr<Song> find(const std::string& key);
+
+      // Caches the song under the key. Songs bigger than the whole budget are
+      // not cached.
+      void insert(const std::string& key, std::shared_ptr<Song> song);
+
+      // Builds the cache key for the file at path, returning false if the
+      // file can't be stat'd.
+      static bool make_key(const std::string& path, std::string *key);
+
+      // Sets the memory budget, dropping songs if they no longer fit.
+      void set_budget(uint64_t budget);
+
+      // Returns the number of cached songs.
+      uint32_t size();
+
+      // Returns the number of bytes taken by the cached songs.
+      uint64_t used_bytes();
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include <dirent.h>           // opendir, readdir, closedir
+#include <errno.h>            // errno
+#include <sched.h>            // sched_yield
+#include <unistd.h>           // write
+#include "midifile/include/MidiFile.h"
+#include "server/song_cache.hpp"
+#include "server/song_loader.hpp"
+
+SongLoader::SongLoader(int notify_fd) : notify_fd(notify_fd), running(false) {
+}
+
+SongLoader::~SongLoader() {
+   stop();
+}
+
+void SongLoader::load(loader::Request_Type type, uint32_t id,
+      const std::string& path) {
+   LoadRequest request;
+   request.type = type;
+   request.id = id;
+   request.path = path;
+
+   std::lock_guard<std::mutex> guard(lock);
+   requests.push_back(request);
+   wakeup.notify_one();
+}
+
+void SongLoader::load_directory(LoadRequest& request) {
+   DIR *dir_stream;
+   struct dirent *entry;
+   std::string name;
+   LoadResult result;
+
+   result.type = loader::DIRECTORY;
+   result.id = request.id;
+   result.path = request.path;
+   result.num_songs = -1;
+
+   dir_stream = opendir(request.path.c_str());
+   if (dir_stream == NULL) {
+      post_result(result);
+      return;
+   }
+
+   // Load every midi file in the directory.
+   result.num_songs = 0;
+   while ((entry = readdir(dir_stream)) != NULL) {
+      name = entry->d_name;
+      if (name.size() < 4 || (name.compare(name.size() - 4, 4, ".mid") != 0 &&
+               name.compare(name.size() - 4, 4, ".MID") != 0)) {
+         continue;
+      }
+
+      if (load_song(request, request.path + "/" + name)) {
+         ++result.num_songs;
+      }
+   }
+   closedir(dir_stream);
+
+   post_result(result);
+}
+
+bool SongLoader::load_song(LoadRequest& request, const std::string& path) {
+   MidiFile midifile;
+   LoadResult result;
+
+   result.type = loader::SONG;
+   result.id = request.id;
+   result.path = path;
+   result.num_songs = 0;
+
+   // Read and compile the midi file, leaving the song NULL if it is no good.
+   if (SongCache::make_key(path, &result.key)) {
+      midifile.read(path);
+      if (midifile.status()) {
+         result.song = std::make_shared<Song>(midifile);
+      }
+   }
+
+   post_result(result);
+   return result.song != NULL;
+}
+
+bool SongLoader::pop_result(LoadResult& result) {
+   return results.pop(result);
+}
+
+void SongLoader::post_result(LoadResult& result) {
+   while (!results.push(result)) {
+      // Nobody will make room once the loader is being stopped.
+      if (!running.load()) {
+         return;
+      }
+      sched_yield();
+   }
+
+   // Wake the server up so it picks the result up promptly.
+   uint8_t poke = 0;
+   if (write(notify_fd, &poke, sizeof(poke)) < 0) {
+      EXCEPT(errno == EAGAIN || errno == EWOULDBLOCK, {});
+   }
+}
+
+void SongLoader::run() {
+   LoadRequest request;
+
+   while (true) {
+      // Sleep until there is something to load.
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         while (running.load() && requests.empty()) {
+            wakeup.wait(guard);
+         }
+         if (!running.load()) {
+            return;
+         }
+         request = requests.front();
+         requests.pop_front();
+      }
+
+      if (request.type == loader::DIRECTORY) {
+         load_directory(request);
+      }
+      else {
+         load_song(request, request.path);
+      }
+   }
+}
+
+void SongLoader::start() {
+   ASSERT(!worker.joinable());
+   running.store(true);
+   worker = std::thread(&SongLoader::run, this);
+}
+
+void SongLoader::stop() {
+   if (worker.joinable()) {
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         running.store(false);
+         requests.clear();
+         wakeup.notify_one();
+      }
+      worker.join();
+   }
+}
@@ -0,0 +1,88 @@
+#ifndef __SONG_LOADER__HPP__
+#define __SONG_LOADER__HPP__
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "server/song.hpp"
+#include "server/spsc_queue.hpp"
+
+#define LOADER_QUEUE_SIZE 256    // Slots in the loader's result queue.
+
+namespace loader {
+   // What the loader is asked to load.
+   enum Request_Type { SONG, DIRECTORY };
+};
+
+typedef struct LoadRequest {
+   loader::Request_Type type;
+   uint32_t id;                  // Id the request's results are tagged with.
+   std::string path;             // Song file or directory to load.
+} LoadRequest;
+
+typedef struct LoadResult {
+   loader::Request_Type type;    // SONG: a song was loaded (or failed to).
+                                 // DIRECTORY: a directory is done loading.
+   uint32_t id;                  // Id of the request this is a result of.
+   std::string path;             // Song file or directory that was loaded.
+   std::string key;              // SONG: song cache key of the file.
+   std::shared_ptr<Song> song;   // SONG: the compiled song (NULL on failure).
+   int num_songs;                // DIRECTORY: songs loaded from it.
+} LoadResult;
+
+// Background thread which opens, parses and compiles midi files, so the
+// server's loop never blocks on disk I/O while clients are syncing or a song
+// is playing. Finished songs are posted to a lock-free queue and a byte is
+// written to notify_fd so the server's reactor wakes up to collect them.
+class SongLoader {
+   private:
+      int notify_fd;                // Poked when a result is posted.
+      std::atomic<bool> running;    // Keeps the loader thread alive.
+      std::thread worker;           // Thread doing the loading.
+
+      std::mutex lock;              // Guards requests.
+      std::condition_variable wakeup; // Signalled when a request is queued.
+      std::deque<LoadRequest> requests; // Requests waiting to be loaded.
+
+      // Loaded songs for the server.
+      SpscQueue<LoadResult, LOADER_QUEUE_SIZE> results;
+
+      // Loads every midi file in the requested directory.
+      void load_directory(LoadRequest& request);
+
+      // Loads the song at path, posting the result tagged with the request's
+      // id. Returns true if the song was good.
+      bool load_song(LoadRequest& request, const std::string& path);
+
+      // Hands a result to the server and wakes it up.
+      void post_result(LoadResult& result);
+
+      // Main loop of the loader's thread.
+      void run();
+
+   public:
+      // Creates a loader which writes a byte to notify_fd for every result.
+      SongLoader(int notify_fd);
+
+      ~SongLoader();
+
+      // Queues the song file or directory at path to be loaded.
+      void load(loader::Request_Type type, uint32_t id,
+            const std::string& path);
+
+      // Pops a result for the server, returning false if there are none.
+      bool pop_result(LoadResult& result);
+
+      // Starts the loader's thread.
+      void start();
+
+      // Stops and joins the loader's thread, dropping pending requests.
+      void stop();
+};
+
+#endif
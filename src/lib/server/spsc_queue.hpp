@@ -0,0 +1,66 @@
+#ifndef __SPSC_QUEUE__HPP__
+#define __SPSC_QUEUE__HPP__
+
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+#include "network/network.hpp"
+
+// Bounded lock-free queue for handing items from exactly one producer thread
+// to exactly one consumer thread. Capacity must be a power of two.
+template <typename T, uint32_t Capacity>
+class SpscQueue {
+   static_assert((Capacity & (Capacity - 1)) == 0,
+         "SpscQueue capacity must be a power of two");
+
+   private:
+      // Next slot the consumer will pop from. The padding keeps the producer
+      // and consumer indices from sharing (and bouncing) a cache line.
+      std::atomic<uint32_t> head;
+      uint8_t head_pad[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+
+      // Next slot the producer will push into.
+      std::atomic<uint32_t> tail;
+      uint8_t tail_pad[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+
+      // Storage for the queued items.
+      T slots[Capacity];
+
+   public:
+      SpscQueue() : head(0), tail(0) {}
+
+      // Returns true if there is nothing to pop. Only meaningful to the
+      // consumer, since the producer can push at any moment.
+      bool empty() {
+         return head.load(std::memory_order_relaxed) ==
+            tail.load(std::memory_order_acquire);
+      }
+
+      // Producer side. Copies the item into the queue, returning false if
+      // the queue is full.
+      bool push(const T& item) {
+         uint32_t t = tail.load(std::memory_order_relaxed);
+         if (t - head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+         }
+
+         slots[t & (Capacity - 1)] = item;
+         tail.store(t + 1, std::memory_order_release);
+         return true;
+      }
+
+      // Consumer side. Moves the oldest item out of the queue, returning
+      // false if the queue is empty.
+      bool pop(T& item) {
+         uint32_t h = head.load(std::memory_order_relaxed);
+         if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+         }
+
+         item = std::move(slots[h & (Capacity - 1)]);
+         head.store(h + 1, std::memory_order_release);
+         return true;
+      }
+};
+
+#endif